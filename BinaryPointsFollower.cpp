@@ -0,0 +1,290 @@
+#include "BinaryPointsFollower.h"
+#include "BinaryPointsLoader.h"
+
+#include <sys/stat.h>
+
+using namespace omega;
+using namespace cyclops;
+
+///////////////////////////////////////////////////////////////////////////////
+BinaryPointsFollower::BinaryPointsFollower(const String& path, 
+    size_t startRecord, size_t pointsPerBatch, size_t maxPoints,
+    ModelInfo* info, const Vector4f& rgbamin, const Vector4f& rgbamax):
+    myPath(path),
+    myPointsPerBatch(pointsPerBatch > 0 ? pointsPerBatch : 1),
+    myMaxPoints(maxPoints),
+    myInfo(info),
+    myDone(false),
+    myNumRecords(startRecord),
+    myRgbaMin(rgbamin),
+    myRgbaMax(rgbamax),
+    myTailPoints(new osg::Vec3Array()),
+    myTailColors(new osg::Vec4Array()),
+    myTailPublished(false),
+    myResidentPoints(0)
+{
+}
+
+///////////////////////////////////////////////////////////////////////////////
+BinaryPointsFollower::~BinaryPointsFollower()
+{
+    stopFollowing();
+}
+
+///////////////////////////////////////////////////////////////////////////////
+void BinaryPointsFollower::setFilter(const String& expr)
+{
+    if(!expr.empty()) myFilter.parse(expr);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+void BinaryPointsFollower::stopFollowing()
+{
+    myDone = true;
+    if(isRunning()) join();
+}
+
+///////////////////////////////////////////////////////////////////////////////
+size_t BinaryPointsFollower::getNumRecords()
+{
+    OpenThreads::ScopedLock<OpenThreads::Mutex> lock(myLock);
+    return myNumRecords;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+void BinaryPointsFollower::run()
+{
+    // Default record size = 7 doubles (X,Y,Z,R,G,B,A)
+    int numFields = 7;
+    size_t recordSize = sizeof(double)* numFields;
+
+    ofmsg("[BinaryPointsFollower] following %1% from record %2%", %myPath %myNumRecords);
+
+    FILE* fin = NULL;
+    struct stat finStat;
+    while(!myDone)
+    {
+        struct stat st;
+        bool exists = (stat(myPath.c_str(), &st) == 0);
+        if(fin != NULL && exists)
+        {
+            // A new file at the same path (i.e. after a log rotation) has a
+            // different inode. A file rewritten in place gets shorter than
+            // what was read so far. Inodes are not available on Windows, so
+            // only the second case is detected there.
+            bool replaced = (st.st_ino != finStat.st_ino || st.st_dev != finStat.st_dev);
+            bool truncated = ((size_t)st.st_size < myNumRecords * recordSize);
+            if(replaced || truncated)
+            {
+                ofmsg("[BinaryPointsFollower] %1% was %2%: following it again from the first record",
+                    %myPath %(replaced ? "replaced" : "truncated"));
+                fclose(fin);
+                fin = NULL;
+                restart();
+            }
+        }
+
+        // The file may not exist yet, or may have been replaced.
+        if(fin == NULL && exists)
+        {
+            fin = fopen(myPath.c_str(), "rb");
+            if(fin != NULL) fstat(fileno(fin), &finStat);
+        }
+        if(fin != NULL)
+        {
+            // Only consider complete records: the writer may be halfway
+            // through appending one.
+            fseek(fin, 0, SEEK_END);
+            size_t numRecords = ftell(fin) / recordSize;
+            if(numRecords > myNumRecords) ingest(fin, numRecords);
+        }
+        OpenThreads::Thread::microSleep(BINARY_POINTS_FOLLOW_INTERVAL * 1000);
+    }
+    if(fin != NULL) fclose(fin);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+void BinaryPointsFollower::restart()
+{
+    // Points read from the old file stay visible. New records never go in
+    // the same batch as old ones.
+    if(!myTailPoints->empty()) publishTail(true);
+
+    OpenThreads::ScopedLock<OpenThreads::Mutex> lock(myLock);
+    myNumRecords = 0;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+void BinaryPointsFollower::ingest(FILE* fin, size_t numRecords)
+{
+    int numFields = 7;
+    size_t recordSize = sizeof(double)* numFields;
+
+    // myNumRecords is only written by this thread, no need to lock for reads.
+    size_t readStart = myNumRecords;
+    fseek(fin, readStart * recordSize, SEEK_SET);
+
+    Vector4f rgbamin = myRgbaMin;
+    Vector4f rgbamax = myRgbaMax;
+    bool tailDirty = false;
+    while(readStart < numRecords && !myDone)
+    {
+        // Read at most what is needed to fill the current tail batch.
+        size_t count = numRecords - readStart;
+        size_t space = myPointsPerBatch - myTailPoints->size();
+        if(count > space) count = space;
+
+        myBuffer.resize(count * numFields);
+        size_t ne = fread(&myBuffer[0], recordSize, count, fin);
+        if(ne == 0) break;
+
+        size_t tailSize = myTailPoints->size();
+        osg::Vec3f point;
+        osg::Vec4f color;
+        for(size_t i = 0; i < ne; i++)
+        {
+            const double* r = &myBuffer[i * numFields];
+            if(!myFilter.empty() && !myFilter.test(r)) continue;
+            point.set(r[0], r[1], r[2]);
+            color.set(r[3], r[4], r[5], r[6]);
+            myTailPoints->push_back(point);
+            myTailColors->push_back(color);
+            for(size_t j = 0; j < 4; j++)
+            {
+                if(color[j] < rgbamin[j]) rgbamin[j] = color[j];
+                if(color[j] > rgbamax[j]) rgbamax[j] = color[j];
+            }
+        }
+        readStart += ne;
+        if(myTailPoints->size() > tailSize) tailDirty = true;
+
+        {
+            OpenThreads::ScopedLock<OpenThreads::Mutex> lock(myLock);
+            myNumRecords = readStart;
+            myRgbaMin = rgbamin;
+            myRgbaMax = rgbamax;
+        }
+
+        if(myTailPoints->size() >= myPointsPerBatch)
+        {
+            publishTail(true);
+            tailDirty = false;
+        }
+    }
+
+    // Make the partially filled tail batch visible right away.
+    if(tailDirty) publishTail(false);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+void BinaryPointsFollower::publishTail(bool complete)
+{
+    osg::Vec3Array* verticesP;
+    osg::Vec4Array* verticesC;
+    if(complete)
+    {
+        // The tail is done: hand its arrays over and start a new one.
+        verticesP = myTailPoints.get();
+        verticesC = myTailColors.get();
+    }
+    else
+    {
+        // The tail will keep growing: publish a snapshot of it.
+        verticesP = new osg::Vec3Array(*myTailPoints);
+        verticesC = new osg::Vec4Array(*myTailColors);
+    }
+
+    osg::Geometry* nodeGeom = new osg::Geometry();
+    nodeGeom->addPrimitiveSet(new osg::DrawArrays(osg::PrimitiveSet::POINTS, 0, verticesP->size()));
+    osg::VertexBufferObject* vboP = nodeGeom->getOrCreateVertexBufferObject();
+    vboP->setUsage(GL_STREAM_DRAW);
+
+    nodeGeom->setUseDisplayList(false);
+    nodeGeom->setUseVertexBufferObjects(true);
+    nodeGeom->setVertexArray(verticesP);
+    nodeGeom->setColorArray(verticesC);
+    nodeGeom->setColorBinding(osg::Geometry::BIND_PER_VERTEX);
+
+    PendingBatch pb;
+    pb.geometry = nodeGeom;
+    pb.replaceTail = myTailPublished;
+    {
+        OpenThreads::ScopedLock<OpenThreads::Mutex> lock(myLock);
+        myPending.push_back(pb);
+    }
+
+    if(complete)
+    {
+        myTailPoints = new osg::Vec3Array();
+        myTailColors = new osg::Vec4Array();
+        myTailPoints->reserve(myPointsPerBatch);
+        myTailColors->reserve(myPointsPerBatch);
+        myTailPublished = false;
+    }
+    else
+    {
+        myTailPublished = true;
+    }
+}
+
+///////////////////////////////////////////////////////////////////////////////
+void BinaryPointsFollower::operator()(osg::Node* node, osg::NodeVisitor* nv)
+{
+    std::vector<PendingBatch> pending;
+    Vector4f rgbamin;
+    Vector4f rgbamax;
+    {
+        OpenThreads::ScopedLock<OpenThreads::Mutex> lock(myLock);
+        pending.swap(myPending);
+        rgbamin = myRgbaMin;
+        rgbamax = myRgbaMax;
+    }
+
+    osg::Group* group = node->asGroup();
+    if(group != NULL && !pending.empty())
+    {
+        foreach(PendingBatch& pb, pending)
+        {
+            size_t numPoints = pb.geometry->getVertexArray()->getNumElements();
+            if(pb.replaceTail && !myGeodes.empty())
+            {
+                osg::Geode* tail = myGeodes.back().get();
+                myResidentPoints -= tail->getDrawable(0)->asGeometry()->getVertexArray()->getNumElements();
+                tail->setDrawable(0, pb.geometry.get());
+                tail->dirtyBound();
+            }
+            else
+            {
+                osg::Geode* geode = new osg::Geode();
+                geode->setCullingActive(true);
+                geode->addDrawable(pb.geometry.get());
+                group->addChild(geode);
+                myGeodes.push_back(geode);
+            }
+            myResidentPoints += numPoints;
+        }
+
+        // Detach the oldest batches (never the tail) when over budget.
+        size_t dropped = 0;
+        while(myResidentPoints > myMaxPoints && myGeodes.size() > 1)
+        {
+            osg::Geode* oldest = myGeodes.front().get();
+            size_t numPoints = oldest->getDrawable(0)->asGeometry()->getVertexArray()->getNumElements();
+            group->removeChild(oldest);
+            myResidentPoints -= numPoints;
+            dropped += numPoints;
+            myGeodes.pop_front();
+        }
+        if(dropped > 0)
+        {
+            oflog(Verbose, "[BinaryPointsFollower] %1%: dropped %2% old appended points, %3% left",
+                %myPath %dropped %myResidentPoints);
+        }
+
+        if(myInfo.get() != NULL)
+        {
+            myInfo->loaderOutput = BinaryPointsLoader::formatLoaderOutput(rgbamin, rgbamax);
+        }
+    }
+    traverse(node, nv);
+}
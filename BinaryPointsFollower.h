@@ -0,0 +1,97 @@
+#ifndef _BINARY_POINTS_FOLLOWER_H_
+#define _BINARY_POINTS_FOLLOWER_H_
+
+#include <omega.h>
+#include <cyclops/cyclops.h>
+
+// OSG
+#include <osg/Group>
+#include <osg/Geode>
+#include <osg/Geometry>
+#include <osg/NodeCallback>
+#include <OpenThreads/Thread>
+#include <OpenThreads/Mutex>
+
+#include <deque>
+
+#include "PointFilter.h"
+
+using namespace omega;
+
+// Interval between file size checks in follow mode, in milliseconds.
+#define BINARY_POINTS_FOLLOW_INTERVAL 50
+
+///////////////////////////////////////////////////////////////////////////////
+// Watches a growing binary points file and turns records appended after
+// startRecord into point batches. Records are decoded on a background thread
+// into a tail batch that grows up to pointsPerBatch points, after which a new
+// tail batch is started. Batches are attached to the node this callback is
+// installed on during the update traversal, so the scene graph is never
+// modified from the follower thread. At most maxPoints appended points are
+// kept: older batches are detached first.
+// If the file is replaced (i.e. rotated) or truncated, it is reopened and
+// followed again from its first record.
+class BinaryPointsFollower: public osg::NodeCallback, public OpenThreads::Thread
+{
+public:
+    BinaryPointsFollower(const String& path, size_t startRecord, size_t pointsPerBatch,
+        size_t maxPoints, cyclops::ModelInfo* info, const Vector4f& rgbamin, const Vector4f& rgbamax);
+    virtual ~BinaryPointsFollower();
+
+    //! Only keeps appended points matching a PointFilter expression. Must be
+    //! called before starting the follower thread.
+    void setFilter(const String& expr);
+
+    //! Stops the follower thread and waits for it to terminate.
+    void stopFollowing();
+
+    //! Returns the number of records read so far, including the ones before
+    //! startRecord.
+    size_t getNumRecords();
+
+    //! Attaches batches decoded since the last call to node.
+    virtual void operator()(osg::Node* node, osg::NodeVisitor* nv);
+
+protected:
+    virtual void run();
+
+private:
+    struct PendingBatch
+    {
+        Ref<osg::Geometry> geometry;
+        // When true, geometry replaces the current tail batch.
+        bool replaceTail;
+    };
+
+    void ingest(FILE* fin, size_t numRecords);
+    void publishTail(bool complete);
+    //! Closes the tail batch and restarts from the first record of a new file.
+    void restart();
+
+private:
+    String myPath;
+    size_t myPointsPerBatch;
+    size_t myMaxPoints;
+    Ref<cyclops::ModelInfo> myInfo;
+    PointFilter myFilter;
+    volatile bool myDone;
+
+    // Protects the fields below, shared with the update traversal.
+    OpenThreads::Mutex myLock;
+    size_t myNumRecords;
+    Vector4f myRgbaMin;
+    Vector4f myRgbaMax;
+    std::vector<PendingBatch> myPending;
+
+    // Tail batch being filled. Follower thread only.
+    Ref<osg::Vec3Array> myTailPoints;
+    Ref<osg::Vec4Array> myTailColors;
+    bool myTailPublished;
+    std::vector<double> myBuffer;
+
+    // Geodes holding appended batches, oldest first, and their total number
+    // of points. The last one holds the tail batch. Update traversal only.
+    std::deque< Ref<osg::Geode> > myGeodes;
+    size_t myResidentPoints;
+};
+#endif
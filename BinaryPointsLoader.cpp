@@ -1,4 +1,5 @@
 #include "BinaryPointsLoader.h"
+#include "BinaryPointsFollower.h"
 
 #include <osg/Geode>
 #include <osg/Point>
@@ -25,8 +26,15 @@ struct LODLevel
 ///////////////////////////////////////////////////////////////////////////////
 BinaryPointsLoader::BinaryPointsLoader(): ModelLoader("points-binary")
 {
-    osgDB::Registry* reg = osgDB::Registry::instance();
-    reg->addReaderWriter(new BinaryPointsReader());
+    // Other loaders (i.e. TextPointsLoader) may create binary loaders too,
+    // but we only need one reader.
+    static bool sReaderRegistered = false;
+    if(!sReaderRegistered)
+    {
+        osgDB::Registry* reg = osgDB::Registry::instance();
+        reg->addReaderWriter(new BinaryPointsReader());
+        sReaderRegistered = true;
+    }
 }
 
 ///////////////////////////////////////////////////////////////////////////////
@@ -41,6 +49,70 @@ bool BinaryPointsLoader::supportsExtension(const String& ext)
 	return false; 
 }
 
+///////////////////////////////////////////////////////////////////////////////
+bool BinaryPointsLoader::parseOptions(const String& options, Options& out)
+{
+    // Parse options (format: 'pointsPerBatch [follow[=maxPoints]] [sharedcache=MB] [filter=expr] [thin=radius] dist:dec+')
+    // where pointsPerBatch is the number of points for each LOD group 
+    // at max LOD, and each distmin:distmax:dec pair is a LOD level with distance from 
+    // eye and decimation level. When follow is specified, records appended
+    // to the file after loading are added to the point cloud as new batches,
+    // keeping at most maxPoints appended points (the oldest batches are
+    // dropped first).
+    // sharedcache enables a cache of decoded batches shared by all processes
+    // on the host, with the given size budget. filter only keeps points
+    // matching a PointFilter expression. thin hides points whose spheres
+    // are hidden by their neighbours at the given radius (see
+    // SphereArrayFilter), and should match the pointScale shader uniform.
+    Vector<String> args = StringUtils::split(options, " ");
+    if(args.empty()) return false;
+    try
+    {
+        out.pointsPerBatch = boost::lexical_cast<size_t>(args[0]);
+        for(int i = 1; i < args.size(); i++)
+        {
+            if(args[i] == "follow") out.follow = true;
+            else if(StringUtils::startsWith(args[i], "follow="))
+            {
+                out.follow = true;
+                out.followMaxPoints = boost::lexical_cast<size_t>(args[i].substr(7));
+            }
+            else if(StringUtils::startsWith(args[i], "sharedcache="))
+            {
+                out.sharedCacheSize = boost::lexical_cast<int>(args[i].substr(12));
+            }
+            else if(StringUtils::startsWith(args[i], "filter="))
+            {
+                out.filterExpression = args[i].substr(7);
+            }
+            else if(StringUtils::startsWith(args[i], "thin="))
+            {
+                out.sphereRadius = boost::lexical_cast<float>(args[i].substr(5));
+            }
+            else
+            {
+                // LOD levels are distmin:distmax:dec
+                Vector<String> lodarg = StringUtils::split(args[i], ":");
+                if(lodarg.size() != 3) return false;
+                for(int j = 0; j < 3; j++) boost::lexical_cast<int>(lodarg[j]);
+                out.lodargs.push_back(args[i]);
+            }
+        }
+    }
+    catch(boost::bad_lexical_cast&)
+    {
+        return false;
+    }
+    return out.pointsPerBatch > 0;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+bool BinaryPointsLoader::checkOptions(const String& options)
+{
+    Options opts;
+    return parseOptions(options, opts);
+}
+
 ///////////////////////////////////////////////////////////////////////////////
 bool BinaryPointsLoader::load(ModelAsset* model)
 {
@@ -56,18 +128,58 @@ bool BinaryPointsLoader::load(ModelAsset* model)
     int numFields = 7;
     size_t recordSize = sizeof(double)* numFields;
     FILE* fin = fopen(path.c_str(), "rb");
+    if(fin == NULL)
+    {
+        ofwarn("BinaryPointsLoader::load: could not open %1%", %path);
+        return false;
+    }
     // How many records are in the file?
     fseek(fin, 0, SEEK_END);
     size_t endpos = ftell(fin);
     size_t numRecords = endpos / recordSize;
     fclose(fin);
 
-    // Parse options (format: 'pointsPerBatch dist:dec+')
-    // where pointsPerBatch is the number of points for each LOD group 
-    // at max LOD, and each distmin:distmax:dec pair is a LOD level with distance from 
-    // eye and decimation level.
-    Vector<String> args = StringUtils::split(model->info->options, " ");
-    size_t pointsPerBatch = boost::lexical_cast<size_t>(args[0]);
+    Options opts;
+    if(!parseOptions(model->info->options, opts))
+    {
+        ofwarn("BinaryPointsLoader::load: invalid options %1%", %model->info->options);
+        return false;
+    }
+    size_t pointsPerBatch = opts.pointsPerBatch;
+    bool follow = opts.follow;
+    int sharedCacheSize = opts.sharedCacheSize;
+    String filterExpression = opts.filterExpression;
+    float sphereRadius = opts.sphereRadius;
+    Vector<String>& lodargs = opts.lodargs;
+
+    PointFilter filter;
+    if(!filterExpression.empty() && !filter.parse(filterExpression))
+    {
+        ofwarn("BinaryPointsLoader::load: invalid filter %1%", %filterExpression);
+        return false;
+    }
+
+    // Create root group for this point cloud
+    Ref<osg::Group> group = new osg::Group();
+
+    float maxf = numeric_limits<float>::max();
+    float minf = -numeric_limits<float>::max();
+    Vector4f rgbamin = Vector4f(maxf, maxf, maxf, maxf);
+    Vector4f rgbamax = Vector4f(minf, minf, minf, minf);
+
+    if(numRecords == 0)
+    {
+        if(!follow)
+        {
+            ofwarn("BinaryPointsLoader::load: %1% contains no points", %path);
+            return false;
+        }
+        // Nothing to page yet: all points will come from the follower.
+        startFollowing(model, group, path, numRecords, pointsPerBatch, opts.followMaxPoints,
+            filterExpression, rgbamin, rgbamax);
+        model->nodes.push_back(group);
+        return true;
+    }
 
     // Convert points per batch to batch length as file size percentage.
     size_t lengthP = pointsPerBatch * BINARY_POINTS_MAX_BATCHES / numRecords;
@@ -86,13 +198,13 @@ bool BinaryPointsLoader::load(ModelAsset* model)
 
     int mindec = 1000000;
     Vector<LODLevel> lodlevels;
-    for(int i = 1; i < args.size(); i++)
+    foreach(String arg, lodargs)
     {
-        Vector<String> lodargs = StringUtils::split(args[i], ":");
+        Vector<String> lodarg = StringUtils::split(arg, ":");
         LODLevel ll(
-            boost::lexical_cast<int>(lodargs[0]),
-            boost::lexical_cast<int>(lodargs[1]),
-            boost::lexical_cast<int>(lodargs[2])
+            boost::lexical_cast<int>(lodarg[0]),
+            boost::lexical_cast<int>(lodarg[1]),
+            boost::lexical_cast<int>(lodarg[2])
             );
 		lodlevels.push_back(ll);
         if(ll.dec < mindec) mindec = ll.dec;
@@ -100,18 +212,20 @@ bool BinaryPointsLoader::load(ModelAsset* model)
 
     oflog(Verbose, "[BinaryPointsLoader] LOD levels: <%1%>", %lodlevels.size());
 
-    // Create root group for this point cloud
-    Ref<osg::Group> group = new osg::Group();
-
     // get base filename (without extension)
     String basename;
     String extension;
     StringUtils::splitBaseFilename(model->info->path, basename, extension);
 
-    float maxf = numeric_limits<float>::max();
-    float minf = -numeric_limits<float>::max();
-    Vector4f rgbamin = Vector4f(maxf, maxf, maxf, maxf);
-    Vector4f rgbamax = Vector4f(minf, minf, minf, minf);
+    // In follow mode the file keeps growing: pin batches to the records
+    // present now, or their percentage ranges would shift as data comes in.
+    String readerOptions = ostr("xyzrgba -b %1%", %(pointsPerBatch / mindec));
+    if(follow) readerOptions = ostr("%1% -n %2%", %readerOptions %numRecords);
+    if(sharedCacheSize > 0) readerOptions = ostr("%1% -m %2%", %readerOptions %sharedCacheSize);
+    if(!filter.empty()) readerOptions = ostr("%1% -q %2%", %readerOptions %filterExpression);
+    if(sphereRadius > 0) readerOptions = ostr("%1% -r %2%", %readerOptions %sphereRadius);
+
+    int skippedBatches = 0;
 
     // Iterate for each batch
     for(int startP = 0; startP <= BINARY_POINTS_MAX_BATCHES; startP += lengthP)
@@ -123,13 +237,14 @@ bool BinaryPointsLoader::load(ModelAsset* model)
         group->addChild(plod);
 
         osgDB::Options* options = new osgDB::Options; 
-        options->setOptionString(ostr("xyzrgba -b %1%", %(pointsPerBatch / mindec)));
+        options->setOptionString(readerOptions);
 
         plod->setDatabaseOptions(options);
         //plod->setCenterMode(osg::LOD::USE_BOUNDING_SPHERE_CENTER);
 
         // Create LOD groups for each batch
 		String filename;
+        bool skip = false;
         foreach(LODLevel ll, lodlevels)
         {
             filename = ostr("%1%.%2%-%3%-%4%.xyzb",
@@ -147,8 +262,16 @@ bool BinaryPointsLoader::load(ModelAsset* model)
         	{
 		        // Load or compute bounds
 		        Ref<osgDB::Options> boundoptions = new osgDB::Options; 
-		        boundoptions->setOptionString(ostr("xyzrgba -b %1% -z", %(pointsPerBatch / mindec)));
-				Ref<osg::Node> n = osgDB::readNodeFile(filename, boundoptions);
+		        boundoptions->setOptionString(readerOptions + " -z");
+
+                // When filtering, batches are skipped based on their bounds,
+                // so they must be computed from all the batch points.
+                String boundsFilename = filename;
+                if(!filter.empty())
+                {
+                    boundsFilename = ostr("%1%.%2%-%3%-1.xyzb", %basename %startP %lengthP);
+                }
+				Ref<osg::Node> n = osgDB::readNodeFile(boundsFilename, boundoptions);
 
 				// The node only stores user data. read it back.
 		        float brgbamin[4];
@@ -170,6 +293,17 @@ bool BinaryPointsLoader::load(ModelAsset* model)
 		        n->getUserValue("amin", brgbamin[3]);
 		        n->getUserValue("amax", brgbamax[3]);
 
+                // Skip batches with no points matching the filter.
+                float bfieldmin[7] = { bpointmin[0], bpointmin[1], bpointmin[2],
+                    brgbamin[0], brgbamin[1], brgbamin[2], brgbamin[3] };
+                float bfieldmax[7] = { bpointmax[0], bpointmax[1], bpointmax[2],
+                    brgbamax[0], brgbamax[1], brgbamax[2], brgbamax[3] };
+                if(!filter.mayMatch(bfieldmin, bfieldmax))
+                {
+                    skip = true;
+                    break;
+                }
+
 		        // Use this batch bounds to upate the point cloud bounds
 		        for(int j = 0; j < 4; j++)
 		        {
@@ -186,23 +320,33 @@ bool BinaryPointsLoader::load(ModelAsset* model)
         	}
             childid++;
         }
+
+        if(skip)
+        {
+            group->removeChild(plod);
+            skippedBatches++;
+        }
+    }
+
+    if(!filter.empty())
+    {
+        ofmsg("[BinaryPointsLoader] filter <%1%> skipped <%2%> batches", 
+            %filterExpression %skippedBatches);
     }
 
     // Save loaded results in the model info
-    string output =
-        ostr("{ "
-        "'minR': %f, 'maxR': %f, "
-        "'minG': %f, 'maxG': %f, "
-        "'minB': %f, 'maxB': %f, "
-        "'minA': %f, 'maxA': %f }",
-        %rgbamin[0] %rgbamax[0]
-        %rgbamin[1] %rgbamax[1]
-        %rgbamin[2] %rgbamax[2]
-        %rgbamin[3] %rgbamax[3]
-        );
+    string output = formatLoaderOutput(rgbamin, rgbamax);
     oflog(Verbose, "[BinaryPointsLoader] model info: <%1%>", %output);
     model->info->loaderOutput = output;
 
+    if(follow)
+    {
+        // Bounds pinned to older record counts will not be used again.
+        BinaryPointsReader::removeStaleBoundsFiles(model->info->path, numRecords);
+        startFollowing(model, group, path, numRecords, pointsPerBatch, opts.followMaxPoints,
+            filterExpression, rgbamin, rgbamax);
+    }
+
     model->nodes.push_back(group);
 
   //  if(node)
@@ -214,3 +358,32 @@ bool BinaryPointsLoader::load(ModelAsset* model)
     return true;
 }
 
+
+///////////////////////////////////////////////////////////////////////////////
+void BinaryPointsLoader::startFollowing(ModelAsset* model, osg::Group* group,
+    const String& path, size_t numRecords, size_t pointsPerBatch, size_t maxPoints,
+    const String& filter, const Vector4f& rgbamin, const Vector4f& rgbamax)
+{
+    // The follower runs as an update callback of the point cloud root, and
+    // stops when the root goes away.
+    BinaryPointsFollower* follower = new BinaryPointsFollower(
+        path, numRecords, pointsPerBatch, maxPoints, model->info, rgbamin, rgbamax);
+    follower->setFilter(filter);
+    group->setUpdateCallback(follower);
+    follower->start();
+}
+
+///////////////////////////////////////////////////////////////////////////////
+String BinaryPointsLoader::formatLoaderOutput(const Vector4f& rgbamin, const Vector4f& rgbamax)
+{
+    return ostr("{ "
+        "'minR': %f, 'maxR': %f, "
+        "'minG': %f, 'maxG': %f, "
+        "'minB': %f, 'maxB': %f, "
+        "'minA': %f, 'maxA': %f }",
+        %rgbamin[0] %rgbamax[0]
+        %rgbamin[1] %rgbamax[1]
+        %rgbamin[2] %rgbamax[2]
+        %rgbamin[3] %rgbamax[3]
+        );
+}
@@ -12,6 +12,10 @@
 //#include <osgDB/FileUtils>
 
 #include "BinaryPointsReader.h"
+#include "PointFilter.h"
+
+// Default maximum number of appended points kept in memory in follow mode.
+#define BINARY_POINTS_FOLLOW_MAX_POINTS 10000000
 
 
 using namespace omega;
@@ -26,6 +30,32 @@ public:
     virtual ~BinaryPointsLoader();
     void initialize();
 
+    //! Returns the loader output string (color ranges) stored in ModelInfo
+    static String formatLoaderOutput(const Vector4f& rgbamin, const Vector4f& rgbamax);
+
+    //! Returns true if options is a valid option string for this loader.
+    static bool checkOptions(const String& options);
+
+private:
+    struct Options
+    {
+        Options(): pointsPerBatch(0), follow(false),
+            followMaxPoints(BINARY_POINTS_FOLLOW_MAX_POINTS), sharedCacheSize(0), sphereRadius(0) {}
+        size_t pointsPerBatch;
+        bool follow;
+        size_t followMaxPoints;
+        int sharedCacheSize;
+        String filterExpression;
+        float sphereRadius;
+        Vector<String> lodargs;
+    };
+
+    static bool parseOptions(const String& options, Options& out);
+
+    void startFollowing(cyclops::ModelAsset* model, osg::Group* group,
+        const String& path, size_t numRecords, size_t pointsPerBatch, size_t maxPoints,
+        const String& filter, const Vector4f& rgbamin, const Vector4f& rgbamax);
+
 private:
 	String format;
 };
@@ -1,10 +1,14 @@
 #include "BinaryPointsReader.h"
+#include "SharedBatchCache.h"
+#include "SphereArrayFilter.h"
 
 #include <osg/Geode>
 #include <osg/Point>
 #include <osgDB/FileNameUtils>
 
 #include <limits>
+#include <sys/stat.h>
+#include <time.h>
 
 using namespace omega;
 
@@ -24,6 +28,10 @@ osgDB::ReaderWriter::ReadResult BinaryPointsReader::readNode(const std::string&
     int readLengthP = 0;
     int decimation = 0;
     int batchSize = 1000;
+    int maxRecords = 0;
+    int sharedCacheSize = 0;
+    String filterExpression;
+    double sphereRadius = 0;
     bool sizeOnly = false;
 
     if(o->getOptionString().size() > 0)
@@ -36,39 +44,46 @@ osgDB::ReaderWriter::ReadResult BinaryPointsReader::readNode(const std::string&
         ah.newNamedInt('l', "length", "length", "number of batches to read", readLengthP);
         ah.newNamedInt('d', "decimation", "decimation", "read decimation", decimation);
         ah.newNamedInt('b', "batch-size", "batch size", "batch size", batchSize);
+        ah.newNamedInt('n', "records", "records", "number of records in file (0 = use file size)", maxRecords);
+        ah.newNamedInt('m', "shared-cache", "shared cache", "host shared batch cache size in MB (0 = disabled)", sharedCacheSize);
+        ah.newNamedString('q', "filter", "filter", "point filter expression (see PointFilter)", filterExpression);
+        ah.newNamedDouble('r', "sphere-radius", "sphere radius", "hide points hidden at this sphere radius (0 = disabled)", sphereRadius);
         ah.newFlag('z', "size", "computes size only (or read from cached", sizeOnly);
         ah.newFlag('F', "float", "Use single precision floating point", useSinglePrecision);
         ah.process(o->getOptionString().c_str());
     }
 
-    Vector<String> elems = StringUtils::split(filename, ".");
-    if(elems.size() == 3)
+    // The filename format is [filepath].[options].xyzb where options are
+    // startP-lengthP-decimation. This filename format is used for paged LOD
+    // loading. Only the last two dots are considered, since directories and
+    // file names can contain dots too.
+    size_t extDot = filename.rfind('.');
+    size_t optionsDot = (extDot != String::npos && extDot > 0) ? filename.rfind('.', extDot - 1) : String::npos;
+    if(optionsDot != String::npos)
     {
-        // The filename format is [filepath].[options].xyzb
-        // where options are startP-lengthP-decimation. This filename format is
-        // used for paged LOD loading.
-        Vector<String> options = StringUtils::split(elems[1], "-");
-
-        if(options.size() != 3)
+        String batch = filename.substr(optionsDot + 1, extDot - optionsDot - 1);
+        Vector<String> options = StringUtils::split(batch, "-");
+        if(options.size() == 3 && batch.find('/') == String::npos)
         {
-            ofwarn("BinaryPointsReader::readNode: wrong filename format %1%", %filename);
-            return ReadResult();
+            try
+            {
+                int startP = boost::lexical_cast<int>(options[0]);
+                int lengthP = boost::lexical_cast<int>(options[1]);
+                int dec = boost::lexical_cast<int>(options[2]);
+                readStartP = startP;
+                readLengthP = lengthP;
+                decimation = dec;
+                actualFilename = filename.substr(0, optionsDot) + filename.substr(extDot);
+            }
+            catch(boost::bad_lexical_cast&)
+            {
+                // Not a batch: the dot is part of the file name.
+            }
         }
 
-        readStartP = boost::lexical_cast<int>(options[0]);
-        readLengthP = boost::lexical_cast<int>(options[1]);
-        decimation = boost::lexical_cast<int>(options[2]);
-
-        actualFilename = elems[0] + "." + elems[2];
-
         //ofmsg("Reading file %1% start=%2% length=%3% dec=%4%", 
         //    %actualFilename %readStartP %readLengthP %decimation);
     }
-    else if(elems.size() != 2)
-    {
-        ofwarn("BinaryPointsReader::readNode: wrong filename format %1%", %filename);
-        return ReadResult();
-    }
 
     String path;
 
@@ -76,16 +91,21 @@ osgDB::ReaderWriter::ReadResult BinaryPointsReader::readNode(const std::string&
     {
         // If we are only getting the point and data bounds for this file,
         // see if we have a result already computed and cached.
-        ReadResult rr = readBoundsFile(filename);
+        ReadResult rr = readBoundsFile(filename, maxRecords);
         if(rr.status() != ReadResult::FILE_NOT_HANDLED) return rr;
     }
 
     if(DataManager::findFile(actualFilename, path))
     {
-        osg::Vec3Array* verticesP = new osg::Vec3Array();
-        osg::Vec4Array* verticesC = new osg::Vec4Array();
+        // Decoded arrays, and the arrays drawn by the batch: the decoded
+        // arrays, or arrays mapping the shared batch cache.
+        osg::ref_ptr<osg::Vec3Array> decodedP;
+        osg::ref_ptr<osg::Vec4Array> decodedC;
+        osg::ref_ptr<osg::Array> verticesP;
+        osg::ref_ptr<osg::Array> verticesC;
 
         size_t numPoints = 0;
+        size_t bytesRead = 0;
         float maxf = numeric_limits<float>::max();
         float minf = -numeric_limits<float>::max();
         Vector4f rgbamin = Vector4f(maxf, maxf, maxf, maxf);
@@ -93,47 +113,112 @@ osgDB::ReaderWriter::ReadResult BinaryPointsReader::readNode(const std::string&
         Vector3f pointmin = Vector3f(maxf, maxf, maxf);
         Vector3f pointmax = Vector3f(minf, minf, minf);
 
-        if(useSinglePrecision)
+        // Points are filtered during decoding. Bounds are always computed on
+        // unfiltered data, since they are used to skip batches that cannot
+        // match a filter.
+        PointFilter pointFilter;
+        const PointFilter* filter = NULL;
+        if(!sizeOnly && !filterExpression.empty() && pointFilter.parse(filterExpression))
         {
-            readXYZ<float>(path,
-            readStartP, readLengthP, decimation, 
-            verticesP, verticesC,
-            &numPoints,
-            &pointmin,
-            &pointmax,
-            &rgbamin,
-            &rgbamax);
+            filter = &pointFilter;
+        }
+
+        // See if another process on this host already decoded this batch.
+        // Bounds are not cached, so bounds requests always read the file.
+        SharedBatchCache* cache = NULL;
+        SharedBatchCache::Result cacheResult = SharedBatchCache::Skip;
+        uint64_t cacheKey = 0;
+        size_t hiddenPoints = 0;
+        if(sharedCacheSize > 0 && !sizeOnly)
+        {
+            cache = SharedBatchCache::instance(sharedCacheSize);
+            if(cache != NULL)
+            {
+                cacheKey = SharedBatchCache::makeKey(path, ostr("%1%-%2%-%3%-%4%-%5%-%6%-%7%",
+                    %readStartP %readLengthP %decimation %maxRecords %useSinglePrecision
+                    %filterExpression %sphereRadius));
+                cacheResult = cache->acquire(cacheKey, verticesP, verticesC, &hiddenPoints);
+            }
+        }
+
+        if(cacheResult == SharedBatchCache::Hit)
+        {
+            numPoints = verticesP->getNumElements();
         }
         else
         {
-            readXYZ<double>(path,
-                readStartP, readLengthP, decimation,
-                verticesP, verticesC,
-                &numPoints,
-                &pointmin,
-                &pointmax,
-                &rgbamin,
-                &rgbamax);
+            bool read = false;
+            if(useSinglePrecision)
+            {
+                read = readXYZ<float>(path,
+                    readStartP, readLengthP, decimation, maxRecords, filter,
+                    decodedP, decodedC,
+                    &numPoints,
+                    &bytesRead,
+                    &pointmin,
+                    &pointmax,
+                    &rgbamin,
+                    &rgbamax);
+            }
+            else
+            {
+                read = readXYZ<double>(path,
+                    readStartP, readLengthP, decimation, maxRecords, filter,
+                    decodedP, decodedC,
+                    &numPoints,
+                    &bytesRead,
+                    &pointmin,
+                    &pointmax,
+                    &rgbamin,
+                    &rgbamax);
+            }
+            if(!read)
+            {
+                // Let other processes decode the batch themselves.
+                if(cacheResult == SharedBatchCache::Publish) cache->abandon(cacheKey);
+                return ReadResult();
+            }
+
+            // Move points hidden by their neighbours to the end of the batch.
+            // This is done before publishing, so processes drawing the batch
+            // from the cache don't filter it again.
+            if(sphereRadius > 0 && !sizeOnly)
+            {
+                SphereArrayFilter sphereFilter(sphereRadius);
+                hiddenPoints = sphereFilter.apply(decodedP.get(), decodedC.get());
+                oflog(Verbose, "[BinaryPointsReader] %1%: %2% of %3% points hidden",
+                    %filename %hiddenPoints %numPoints);
+            }
+
+            verticesP = decodedP;
+            verticesC = decodedC;
+            if(cacheResult == SharedBatchCache::Publish &&
+                cache->publish(cacheKey, decodedP.get(), decodedC.get(), hiddenPoints, verticesP, verticesC))
+            {
+                // The batch is drawn from the cache: the decoded arrays go
+                // back to the array pool.
+                decodedP = NULL;
+                decodedC = NULL;
+            }
         }
+
         if(sizeOnly)
         {
             //omsg("Computing data bounds");
 
             // Generate the bounds file
-            String boundsBasename;
-            String boundsExtension;
-            String boundsPath;
-            StringUtils::splitFullFilename(filename, boundsBasename, boundsExtension, boundsPath);
+            String boundsFileName = getBoundsFilename(filename, maxRecords);
 
             // make sure path exists
-            String p = boundsPath + "bounds";
+            String p = boundsFileName.substr(0, boundsFileName.rfind('/'));
             //ofmsg("Creating path %1%", %p);
             DataManager::createPath(p);
 
-            // Open bounds file and write bounds data.
-            String boundsFileName = boundsPath + "bounds/" + boundsBasename + ".bounds";
+            // Open bounds file and write bounds data. Bounds are used to skip
+            // batches when filtering, so they are written at full precision
+            // (9 significant digits round trip floats exactly).
             FILE* bf = fopen(boundsFileName.c_str(), "w");
-            fprintf(bf, "%f, %f, %f, %f, %f, %f, %f, %f, %f, %f, %f, %f, %f, %f",
+            fprintf(bf, "%.9g, %.9g, %.9g, %.9g, %.9g, %.9g, %.9g, %.9g, %.9g, %.9g, %.9g, %.9g, %.9g, %.9g",
                 pointmin[0], pointmax[0],
                 pointmin[1], pointmax[1],
                 pointmin[2], pointmax[2],
@@ -144,75 +229,72 @@ osgDB::ReaderWriter::ReadResult BinaryPointsReader::readNode(const std::string&
             fclose(bf);
 
             // Read the bounds file and return the result.
-            ReadResult rr = readBoundsFile(filename);
+            ReadResult rr = readBoundsFile(filename, maxRecords);
             if(rr.status() != ReadResult::FILE_NOT_HANDLED) return rr;
             ofwarn("Could not read bounds file for %1%", %filename);
             return rr;
         }
 
         // create geometry and geodes to hold the data
-        osg::Geode* geode = new osg::Geode();
-        geode->setCullingActive(true);
-
-        // hack 
-/*        batchSize = verticesP->size();
-
-        int numBatches = 1; //verticesP->size() / batchSize;
-        ofmsg("%1%: creating %2% batches of %3% points", %filename %numBatches %batchSize);
-        int batchStart = 0;
-        for(int batchId = 0; batchId < numBatches; batchId++)
+        size_t visiblePoints = verticesP->getNumElements() - hiddenPoints;
+        osg::Node* node = createGeode(verticesP.get(), verticesC.get(), 0, visiblePoints);
+        if(hiddenPoints > 0)
         {
-
-            int prims = batchSize;
-            if(batchStart + prims > verticesP->size())
-            {
-                prims = verticesP->size() - batchStart;
-            }
-            osg::Geometry* nodeGeom = new osg::Geometry();
-            osg::StateSet *state = nodeGeom->getOrCreateStateSet();
-            nodeGeom->addPrimitiveSet(new osg::DrawArrays(osg::PrimitiveSet::POINTS, batchStart, prims));
-            osg::VertexBufferObject* vboP = nodeGeom->getOrCreateVertexBufferObject();
-            vboP->setUsage(GL_STREAM_DRAW);
-
-            nodeGeom->setUseDisplayList(false);
-            nodeGeom->setUseVertexBufferObjects(true);
-            nodeGeom->setVertexArray(verticesP);
-            nodeGeom->setColorArray(verticesC);
-            nodeGeom->setColorBinding(osg::Geometry::BIND_PER_VERTEX);
-
-            geode->addDrawable(nodeGeom);
-            batchStart += prims;
-
+            // Hidden points get their own geode, shown only when the sphere
+            // filter is disabled (i.e. for transparent splats).
+            osg::Geode* hiddenGeode = createGeode(verticesP.get(), verticesC.get(), visiblePoints, hiddenPoints);
+            hiddenGeode->setNodeMask(SphereArrayFilter::isEnabled() ? 0 : ~0);
+            osg::Group* group = new osg::Group();
+            group->addChild(node);
+            group->addChild(hiddenGeode);
+            group->setUpdateCallback(SphereArrayFilter::getSwitchCallback());
+            node = group;
         }
-*/
-        // NOBATCH
-        osg::Geometry* nodeGeom = new osg::Geometry();
-        osg::StateSet *state = nodeGeom->getOrCreateStateSet();
-        nodeGeom->addPrimitiveSet(new osg::DrawArrays(osg::PrimitiveSet::POINTS, 0, verticesP->size()));
-        osg::VertexBufferObject* vboP = nodeGeom->getOrCreateVertexBufferObject();
-        vboP->setUsage(GL_STREAM_DRAW);
-
-        nodeGeom->setUseDisplayList(false);
-        nodeGeom->setUseVertexBufferObjects(true);
-        nodeGeom->setVertexArray(verticesP);
-        nodeGeom->setColorArray(verticesC);
-        nodeGeom->setColorBinding(osg::Geometry::BIND_PER_VERTEX);
-        // NOBATCH
-
-        geode->addDrawable(nodeGeom);
-
-        geode->dirtyBound();
-        //grp->addChild(geode);
+
+        // Bytes actually read from the file (0 for shared cache hits)
+        node->setUserValue("bytesRead", (double)bytesRead);
 
         //omsg(model->info->loaderOutput);
 
-        return ReadResult(geode);
+        return ReadResult(node);
     }
     return ReadResult();
 }
 
 ///////////////////////////////////////////////////////////////////////////////
-osgDB::ReaderWriter::ReadResult BinaryPointsReader::readBoundsFile(const String& filename) const
+osg::Geode* BinaryPointsReader::createGeode(osg::Array* points, osg::Array* colors, size_t first, size_t count) const
+{
+    osg::Geode* geode = new osg::Geode();
+    geode->setCullingActive(true);
+
+    // NOBATCH
+    osg::Geometry* nodeGeom = new osg::Geometry();
+    nodeGeom->addPrimitiveSet(new osg::DrawArrays(osg::PrimitiveSet::POINTS, first, count));
+    osg::VertexBufferObject* vboP = nodeGeom->getOrCreateVertexBufferObject();
+    vboP->setUsage(GL_STREAM_DRAW);
+
+    nodeGeom->setUseDisplayList(false);
+    nodeGeom->setUseVertexBufferObjects(true);
+    nodeGeom->setVertexArray(points);
+    nodeGeom->setColorArray(colors);
+    nodeGeom->setColorBinding(osg::Geometry::BIND_PER_VERTEX);
+    // NOBATCH
+
+    if(dynamic_cast<osg::Vec3Array*>(points) == NULL)
+    {
+        const osg::Vec3f* vertices = (const osg::Vec3f*)points->getDataPointer();
+        osg::BoundingBox box;
+        for(size_t i = first; i < first + count; i++) box.expandBy(vertices[i]);
+        nodeGeom->setComputeBoundingBoxCallback(new BatchBoundingBox(box));
+    }
+
+    geode->addDrawable(nodeGeom);
+    geode->dirtyBound();
+    return geode;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+String BinaryPointsReader::getBoundsFilename(const String& filename, size_t maxRecords) const
 {
     // Results will be in a file with same name as the one we want to open,
     // but with extension .bounds, in a directory called bounds
@@ -220,10 +302,62 @@ osgDB::ReaderWriter::ReadResult BinaryPointsReader::readBoundsFile(const String&
     String boundsBasename;
     String boundsExtension;
     String boundsPath;
-    String path;
     StringUtils::splitFullFilename(filename, boundsBasename, boundsExtension, boundsPath);
 
-    String boundsFileName = boundsPath + "bounds/" + boundsBasename + ".bounds";
+    if(maxRecords > 0)
+    {
+        return ostr("%1%bounds/%2%.n%3%.bounds", %boundsPath %boundsBasename %maxRecords);
+    }
+    return boundsPath + "bounds/" + boundsBasename + ".bounds";
+}
+
+///////////////////////////////////////////////////////////////////////////////
+void BinaryPointsReader::removeStaleBoundsFiles(const String& datafile, size_t maxRecords)
+{
+    String basename;
+    String extension;
+    String path;
+    StringUtils::splitFullFilename(datafile, basename, extension, path);
+    String boundsPath = path + "bounds/";
+
+    // Pinned batch bounds files are named basename.start-length-dec.nRecords.bounds
+    time_t now = time(NULL);
+    int removed = 0;
+    osgDB::DirectoryContents files = osgDB::getDirectoryContents(boundsPath);
+    foreach(const String& f, files)
+    {
+        if(!StringUtils::startsWith(f, basename + ".")) continue;
+        Vector<String> parts = StringUtils::split(f.substr(basename.size() + 1), ".");
+        if(parts.size() != 3 || parts[2] != "bounds" || parts[1].size() < 2 || parts[1][0] != 'n') continue;
+
+        size_t records = 0;
+        try
+        {
+            records = boost::lexical_cast<size_t>(parts[1].substr(1));
+        }
+        catch(boost::bad_lexical_cast&)
+        {
+            continue;
+        }
+        if(records == maxRecords) continue;
+
+        String boundsFileName = boundsPath + f;
+        struct stat st;
+        if(stat(boundsFileName.c_str(), &st) != 0 || 
+            difftime(now, st.st_mtime) < BINARY_POINTS_STALE_BOUNDS_AGE) continue;
+        if(remove(boundsFileName.c_str()) == 0) removed++;
+    }
+    if(removed > 0)
+    {
+        ofmsg("[BinaryPointsReader] removed %1% stale bounds files for %2%", %removed %datafile);
+    }
+}
+
+///////////////////////////////////////////////////////////////////////////////
+osgDB::ReaderWriter::ReadResult BinaryPointsReader::readBoundsFile(const String& filename, size_t maxRecords) const
+{
+    String path;
+    String boundsFileName = getBoundsFilename(filename, maxRecords);
     if(DataManager::findFile(boundsFileName, path))
     {
         String boundsText = DataManager::readTextFile(path);
@@ -231,10 +365,20 @@ osgDB::ReaderWriter::ReadResult BinaryPointsReader::readBoundsFile(const String&
         // xmin, xmax, ymin, ymax, zmin, zmax, rmin, rmax, gmin, gmax, bmin, bmax, amin, amax
         Vector<String> vals = StringUtils::split(boundsText, ",");
         float values[14];
-        for(int i = 0; i < 14; i++)
+        if(vals.size() < 14) return ReadResult();
+        try
         {
-            StringUtils::trim(vals[i]);
-            values[i] = boost::lexical_cast<float>(vals[i]);
+            for(int i = 0; i < 14; i++)
+            {
+                StringUtils::trim(vals[i]);
+                values[i] = boost::lexical_cast<float>(vals[i]);
+            }
+        }
+        catch(boost::bad_lexical_cast&)
+        {
+            // Bounds are recomputed.
+            ofwarn("BinaryPointsReader::readBoundsFile invalid bounds file %1%", %boundsFileName);
+            return ReadResult();
         }
         Ref<osg::Node> n = new osg::Node();
         n->setUserValue("xmin", values[0]);
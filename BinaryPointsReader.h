@@ -5,6 +5,8 @@
 
 // OSG
 #include <osg/Group>
+#include <osg/Geode>
+#include <osg/Drawable>
 #include <osg/Vec3>
 #include <osg/Uniform>
 #include <osgDB/ReadFile>
@@ -12,11 +14,33 @@
 #include <osgDB/ReaderWriter>
 #include <osg/ValueObject>
 
+#include "PointArrayPool.h"
+#include "PointFilter.h"
+
 using namespace omega;
 
 // Maximum number of batches a file can be split into.
 #define BINARY_POINTS_MAX_BATCHES 100
+// Age (in seconds) after which bounds pinned to an old number of records are
+// removed. Other processes may still be loading the file with that number of
+// records before that.
+#define BINARY_POINTS_STALE_BOUNDS_AGE 60
+
+///////////////////////////////////////////////////////////////////////////////
+// Bounding box of a batch drawing an array osg cannot compute bounds for,
+// since it does not know the array type (i.e. arrays mapping shared memory or
+// python buffers).
+class BatchBoundingBox: public osg::Drawable::ComputeBoundingBoxCallback
+{
+public:
+    BatchBoundingBox(const osg::BoundingBox& box): myBox(box) {}
+    virtual osg::BoundingBox computeBound(const osg::Drawable&) const { return myBox; }
 
+private:
+    osg::BoundingBox myBox;
+};
+
+///////////////////////////////////////////////////////////////////////////////
 class BinaryPointsReader: public osgDB::ReaderWriter
 {
 public:
@@ -29,28 +53,49 @@ public:
 
     virtual ReadResult readNode(const std::string& filename, const Options*) const;
 
+    //! Removes batch bounds files of datafile pinned to a number of records
+    //! other than maxRecords (see getBoundsFilename), that have not been
+    //! written for BINARY_POINTS_STALE_BOUNDS_AGE seconds.
+    static void removeStaleBoundsFiles(const String& datafile, size_t maxRecords);
+
 private:
+    //! Reads and decodes a range of records. Returns false if the file could
+    //! not be read.
     template<typename T>
-    void readXYZ(
+    bool readXYZ(
         const String& filename,
-        int readStartP, int readLengthP, int decimation,
-        osg::Vec3Array* points, osg::Vec4Array* colors,
+        int readStartP, int readLengthP, int decimation, size_t maxRecords,
+        const PointFilter* filter,
+        osg::ref_ptr<osg::Vec3Array>& points, osg::ref_ptr<osg::Vec4Array>& colors,
         size_t* numPoints,
+        size_t* bytesRead,
         Vector3f* pointmin,
         Vector3f* pointmax,
         Vector4f* rgbamin,
         Vector4f* rgbamax) const;
 
-    ReadResult readBoundsFile(const String& datafile) const;
+    //! Creates a geode drawing count points starting at first. Arrays can be
+    //! shared between geodes, and can be float arrays of any type (i.e.
+    //! arrays mapping the shared batch cache).
+    osg::Geode* createGeode(osg::Array* points, osg::Array* colors, size_t first, size_t count) const;
+
+    //! Returns the path of the bounds file for a data file. When the number
+    //! of records is pinned (i.e. for files that keep growing), it is part of
+    //! the name so bounds computed on a different number of records are
+    //! never reused.
+    String getBoundsFilename(const String& datafile, size_t maxRecords) const;
+    ReadResult readBoundsFile(const String& datafile, size_t maxRecords) const;
 };
 
 ///////////////////////////////////////////////////////////////////////////////
 template<typename T>
-void BinaryPointsReader::readXYZ(
+bool BinaryPointsReader::readXYZ(
     const String& filename,
-    int readStartP, int readLengthP, int decimation,
-    osg::Vec3Array* points, osg::Vec4Array* colors,
+    int readStartP, int readLengthP, int decimation, size_t maxRecords,
+    const PointFilter* filter,
+    osg::ref_ptr<osg::Vec3Array>& points, osg::ref_ptr<osg::Vec4Array>& colors,
     size_t* numPoints,
+    size_t* bytesRead,
     Vector3f* pointmin,
     Vector3f* pointmax,
     Vector4f* rgbamin,
@@ -64,12 +109,20 @@ void BinaryPointsReader::readXYZ(
     size_t recordSize = sizeof(T)* numFields;
 
     FILE* fin = fopen(filename.c_str(), "rb");
+    if(fin == NULL)
+    {
+        ofwarn("BinaryPointsLoader::readXYZ: could not open %1%", %filename);
+        return false;
+    }
 
     // How many records are in the file?
     fseek(fin, 0, SEEK_END);
     size_t endpos = ftell(fin);
     fseek(fin, 0, SEEK_SET);
     size_t numRecords = endpos / recordSize;
+    // Files that are still being written may be read as if they had a fixed
+    // number of records, to keep batch ranges stable.
+    if(maxRecords > 0 && maxRecords < numRecords) numRecords = maxRecords;
     size_t readStart = numRecords * readStartP / BINARY_POINTS_MAX_BATCHES;
     size_t readLength = numRecords * readLengthP / BINARY_POINTS_MAX_BATCHES;
 
@@ -88,13 +141,16 @@ void BinaryPointsReader::readXYZ(
     //ofmsg("BinaryPointsLoader: reading records %1% - %2% of %3% (decimation %4%) of %5%",
     //    %readStart % (readStart + readLength) % numRecords %decimation %filename);
 
-    // Read in data
-    T* buffer = (T*)malloc(recordSize * readLength / decimation);
+    // Read in data. Staging buffers and output arrays come from the array
+    // pool, so steady state paging does not hit the heap.
+    PointArrayPool* pool = PointArrayPool::instance();
+    T* buffer = (T*)pool->getBuffer(recordSize * readLength / decimation);
     if(buffer == NULL)
     {
         oferror("BinaryPointsLoader::readXYZ: could not allocate %1% bytes",
             % (recordSize * readLength / decimation));
-        return;
+        fclose(fin);
+        return false;
     }
 
     size_t ne = readLength / decimation;
@@ -104,6 +160,7 @@ void BinaryPointsReader::readXYZ(
     if(decimation == 1)
     {
         size_t size = fread(buffer, recordSize, readLength, fin);
+        *bytesRead += size * recordSize;
     }
     else
     {
@@ -120,13 +177,31 @@ void BinaryPointsReader::readXYZ(
             size_t offs = ((size_t)recordSize) * (i * (decimation)+recordoffset);
             fseek(fin, (readStart * recordSize) + offs, SEEK_SET);
             size_t size = fread(&buffer[j], recordSize, 1, fin);
+            *bytesRead += size * recordSize;
 
             j += numFields;
         }
     }
 
-    points->reserve(ne);
-    colors->reserve(ne);
+    // Apply the filter on the staging buffer, compacting matching records
+    // at its start, so only those get converted and uploaded.
+    if(filter != NULL && !filter->empty())
+    {
+        size_t nm = 0;
+        for(size_t i = 0; i < ne; i++)
+        {
+            T* record = &buffer[i * numFields];
+            if(filter->test(record))
+            {
+                if(nm != i) memcpy(&buffer[nm * numFields], record, recordSize);
+                nm++;
+            }
+        }
+        ne = nm;
+    }
+
+    points = pool->getPoints(ne);
+    colors = pool->getColors(ne);
 
     size_t j = 0;
     for(size_t i = 0; i < ne; i++)
@@ -158,6 +233,7 @@ void BinaryPointsReader::readXYZ(
     }
 
     fclose(fin);
-    free(buffer);
+    pool->releaseBuffer(buffer);
+    return true;
 }
 #endif
@@ -0,0 +1,201 @@
+#include "PointArrayPool.h"
+
+#include <OpenThreads/ScopedLock>
+
+using namespace omega;
+
+// Staging buffers are prefixed by a header storing their size class,
+// capacity and the size requested by their current user.
+struct BufferHeader
+{
+    size_t sizeClass;
+    size_t capacity;
+    size_t size;
+};
+
+///////////////////////////////////////////////////////////////////////////////
+PointArrayPool* PointArrayPool::instance()
+{
+    static PointArrayPool sInstance;
+    return &sInstance;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+PointArrayPool::PointArrayPool()
+{
+}
+
+///////////////////////////////////////////////////////////////////////////////
+int PointArrayPool::getSizeClass(size_t n)
+{
+    int c = 0;
+    while(getClassCapacity(c) < n && c < POINT_ARRAY_POOL_CLASSES - 1) c++;
+    return c;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+size_t PointArrayPool::getClassCapacity(int c)
+{
+    // Classes go from one power of two to the next in quarter steps.
+    size_t base = (size_t)POINT_ARRAY_POOL_MIN_SIZE << (c / POINT_ARRAY_POOL_CLASS_STEPS);
+    return base + base * (c % POINT_ARRAY_POOL_CLASS_STEPS) / POINT_ARRAY_POOL_CLASS_STEPS;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+template<typename A>
+osg::ref_ptr<A> PointArrayPool::getArray(Vector< osg::ref_ptr<A> >* classes, size_t n)
+{
+    int c = getSizeClass(n);
+    size_t capacity = getClassCapacity(c);
+    if(capacity < n) capacity = n;
+
+    OpenThreads::ScopedLock<OpenThreads::Mutex> lock(myLock);
+    Vector< osg::ref_ptr<A> >& arrays = classes[c];
+
+    // Arrays only referenced by the pool are free. Hand out the first one
+    // and drop free arrays in excess of the pool limit. The returned
+    // reference is taken while holding the lock, so the array can't be
+    // handed out twice.
+    A* result = NULL;
+    int numFree = 0;
+    for(size_t i = 0; i < arrays.size();)
+    {
+        if(arrays[i]->referenceCount() == 1)
+        {
+            if(result == NULL) result = arrays[i].get();
+            else if(++numFree > POINT_ARRAY_POOL_MAX_FREE)
+            {
+                arrays[i] = arrays.back();
+                arrays.pop_back();
+                continue;
+            }
+        }
+        i++;
+    }
+
+    if(result != NULL)
+    {
+        // Detach from the buffer object of the geometry that used the array
+        // last, and make sure the new contents get uploaded.
+        result->setBufferObject(NULL);
+        result->clear();
+        result->dirty();
+        myStats.arrayReuses++;
+        return result;
+    }
+
+    result = new A();
+    result->reserve(capacity);
+    arrays.push_back(result);
+    myStats.arrayAllocations++;
+    return result;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+osg::ref_ptr<osg::Vec3Array> PointArrayPool::getPoints(size_t n)
+{
+    return getArray(myPoints, n);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+osg::ref_ptr<osg::Vec4Array> PointArrayPool::getColors(size_t n)
+{
+    return getArray(myColors, n);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+void* PointArrayPool::getBuffer(size_t size)
+{
+    int c = getSizeClass(size);
+    size_t capacity = getClassCapacity(c);
+    if(capacity < size) capacity = size;
+
+    BufferHeader* buffer = NULL;
+    {
+        OpenThreads::ScopedLock<OpenThreads::Mutex> lock(myLock);
+        // Buffers in the largest class may have different sizes: only reuse
+        // them if they are big enough.
+        Vector<void*>& buffers = myBuffers[c];
+        for(size_t i = buffers.size(); i > 0; i--)
+        {
+            BufferHeader* b = (BufferHeader*)buffers[i - 1];
+            if(b->capacity >= size)
+            {
+                buffer = b;
+                buffers.erase(buffers.begin() + (i - 1));
+                myStats.bufferReuses++;
+                break;
+            }
+        }
+        if(buffer == NULL) myStats.bufferAllocations++;
+        else myStats.bufferUsedBytes += size;
+    }
+
+    if(buffer == NULL)
+    {
+        buffer = (BufferHeader*)malloc(sizeof(BufferHeader) + capacity);
+        if(buffer == NULL) return NULL;
+        buffer->sizeClass = c;
+        buffer->capacity = capacity;
+
+        OpenThreads::ScopedLock<OpenThreads::Mutex> lock(myLock);
+        myStats.bufferBytes += capacity;
+        myStats.bufferUsedBytes += size;
+    }
+    buffer->size = size;
+    return buffer + 1;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+void PointArrayPool::releaseBuffer(void* buffer)
+{
+    if(buffer == NULL) return;
+    BufferHeader* b = (BufferHeader*)buffer - 1;
+    size_t c = b->sizeClass;
+
+    OpenThreads::ScopedLock<OpenThreads::Mutex> lock(myLock);
+    myStats.bufferUsedBytes -= b->size;
+    if(myBuffers[c].size() < POINT_ARRAY_POOL_MAX_FREE)
+    {
+        myBuffers[c].push_back(b);
+    }
+    else
+    {
+        myStats.bufferBytes -= b->capacity;
+        free(b);
+    }
+}
+
+///////////////////////////////////////////////////////////////////////////////
+template<typename A>
+void PointArrayPool::addArrayStats(const Vector< osg::ref_ptr<A> >& arrays, Stats& s)
+{
+    size_t elementSize = sizeof(typename A::ElementDataType);
+    for(size_t i = 0; i < arrays.size(); i++)
+    {
+        s.arrayBytes += arrays[i]->capacity() * elementSize;
+        if(arrays[i]->referenceCount() == 1)
+        {
+            s.arraysFree++;
+        }
+        else
+        {
+            s.arraysInUse++;
+            s.arrayUsedBytes += arrays[i]->size() * elementSize;
+        }
+    }
+}
+
+///////////////////////////////////////////////////////////////////////////////
+PointArrayPool::Stats PointArrayPool::getStats()
+{
+    OpenThreads::ScopedLock<OpenThreads::Mutex> lock(myLock);
+    Stats s = myStats;
+    for(int c = 0; c < POINT_ARRAY_POOL_CLASSES; c++)
+    {
+        addArrayStats(myPoints[c], s);
+        addArrayStats(myColors[c], s);
+        s.buffersFree += myBuffers[c].size();
+    }
+    return s;
+}
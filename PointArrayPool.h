@@ -0,0 +1,94 @@
+#ifndef _POINT_ARRAY_POOL_H_
+#define _POINT_ARRAY_POOL_H_
+
+#include <omega.h>
+
+// OSG
+#include <osg/Array>
+#include <OpenThreads/Mutex>
+
+using namespace omega;
+
+// Capacity of the smallest size class, in elements (or bytes for buffers).
+#define POINT_ARRAY_POOL_MIN_SIZE 1024
+// Number of size classes per doubling of the capacity. With 4 steps, class
+// capacities grow by a quarter of the previous power of two, so arrays and
+// buffers are at most 25% larger than requested.
+#define POINT_ARRAY_POOL_CLASS_STEPS 4
+// Number of size classes.
+#define POINT_ARRAY_POOL_CLASSES (32 * POINT_ARRAY_POOL_CLASS_STEPS)
+// Maximum number of unused arrays or buffers kept in each size class.
+#define POINT_ARRAY_POOL_MAX_FREE 32
+
+///////////////////////////////////////////////////////////////////////////////
+// Pool of point / color arrays and staging buffers used by the paging
+// readers. Array capacities are rounded up to size classes (quarter steps
+// between powers of two), so that arrays released by a batch can be reused by
+// any later batch of a similar size.
+// The pool keeps a reference to every array it hands out: an array is free
+// again when the pool holds the only reference to it, i.e. when the paged
+// node using it has expired. Buffers are returned explicitly.
+class PointArrayPool
+{
+public:
+    struct Stats
+    {
+        Stats(): arrayAllocations(0), arrayReuses(0), arraysInUse(0), arraysFree(0),
+            arrayBytes(0), arrayUsedBytes(0), bufferAllocations(0), bufferReuses(0), buffersFree(0),
+            bufferBytes(0), bufferUsedBytes(0) {}
+
+        // Number of arrays allocated from the heap / taken from the pool.
+        size_t arrayAllocations;
+        size_t arrayReuses;
+        // Arrays currently used by batches / available for reuse.
+        size_t arraysInUse;
+        size_t arraysFree;
+        // Total capacity of arrays owned by the pool, and size of the
+        // elements of arrays in use, in bytes.
+        size_t arrayBytes;
+        size_t arrayUsedBytes;
+        // Number of staging buffers allocated from the heap / taken from the pool.
+        size_t bufferAllocations;
+        size_t bufferReuses;
+        size_t buffersFree;
+        // Total capacity of buffers owned by the pool, and size requested
+        // for buffers in use, in bytes.
+        size_t bufferBytes;
+        size_t bufferUsedBytes;
+    };
+
+    static PointArrayPool* instance();
+
+    //! Returns an empty array with capacity for at least n elements. The
+    //! array goes back to the pool when the returned reference and all the
+    //! references taken from it are released.
+    osg::ref_ptr<osg::Vec3Array> getPoints(size_t n);
+    osg::ref_ptr<osg::Vec4Array> getColors(size_t n);
+
+    //! Returns a staging buffer of at least size bytes. Buffers must be
+    //! returned with releaseBuffer.
+    void* getBuffer(size_t size);
+    void releaseBuffer(void* buffer);
+
+    Stats getStats();
+
+private:
+    PointArrayPool();
+
+    template<typename A>
+    osg::ref_ptr<A> getArray(Vector< osg::ref_ptr<A> >* classes, size_t n);
+
+    template<typename A>
+    static void addArrayStats(const Vector< osg::ref_ptr<A> >& arrays, Stats& s);
+
+    static int getSizeClass(size_t n);
+    static size_t getClassCapacity(int c);
+
+private:
+    OpenThreads::Mutex myLock;
+    Vector< osg::ref_ptr<osg::Vec3Array> > myPoints[POINT_ARRAY_POOL_CLASSES];
+    Vector< osg::ref_ptr<osg::Vec4Array> > myColors[POINT_ARRAY_POOL_CLASSES];
+    Vector<void*> myBuffers[POINT_ARRAY_POOL_CLASSES];
+    Stats myStats;
+};
+#endif
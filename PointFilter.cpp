@@ -0,0 +1,81 @@
+#include "PointFilter.h"
+
+#include <float.h>
+#include <math.h>
+
+using namespace omega;
+
+// Absolute error of bounds files written with %f (6 decimals)
+#define POINT_FILTER_BOUNDS_ERROR 1e-6
+
+///////////////////////////////////////////////////////////////////////////////
+bool PointFilter::parse(const String& expr)
+{
+    static const char* fields = "xyzrgba";
+
+    myClauses.clear();
+    Vector<String> clauses = StringUtils::split(expr, "&");
+    foreach(String c, clauses)
+    {
+        StringUtils::trim(c);
+        Clause clause;
+        const char* f = c.size() > 0 ? strchr(fields, c[0]) : NULL;
+        if(f == NULL || c.size() < 3)
+        {
+            ofwarn("PointFilter: invalid clause '%1%' in %2%", %c %expr);
+            myClauses.clear();
+            return false;
+        }
+        clause.field = f - fields;
+
+        size_t valueStart = 2;
+        if(c[1] == '<') clause.op = Less;
+        else if(c[1] == '>') clause.op = Greater;
+        else
+        {
+            ofwarn("PointFilter: invalid operator in '%1%'", %c);
+            myClauses.clear();
+            return false;
+        }
+        if(c[2] == '=')
+        {
+            clause.op = (clause.op == Less ? LessEqual : GreaterEqual);
+            valueStart = 3;
+        }
+
+        char* end;
+        const char* value = c.c_str() + valueStart;
+        clause.value = strtod(value, &end);
+        if(end == value || *end != '\0')
+        {
+            ofwarn("PointFilter: invalid value in '%1%'", %c);
+            myClauses.clear();
+            return false;
+        }
+        myClauses.push_back(clause);
+    }
+    return true;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+bool PointFilter::mayMatch(const float* fieldmin, const float* fieldmax) const
+{
+    foreach(const Clause& c, myClauses)
+    {
+        // Bounds went through float and text conversions: widen them by
+        // the rounding error (a few float ulps, plus the error of old
+        // bounds files written with 6 decimals).
+        double vmin = fieldmin[c.field];
+        double vmax = fieldmax[c.field];
+        vmin -= fabs(vmin) * 4 * FLT_EPSILON + POINT_FILTER_BOUNDS_ERROR;
+        vmax += fabs(vmax) * 4 * FLT_EPSILON + POINT_FILTER_BOUNDS_ERROR;
+        switch(c.op)
+        {
+        case Less: if(!(vmin < c.value)) return false; break;
+        case LessEqual: if(!(vmin <= c.value)) return false; break;
+        case Greater: if(!(vmax > c.value)) return false; break;
+        case GreaterEqual: if(!(vmax >= c.value)) return false; break;
+        }
+    }
+    return true;
+}
@@ -0,0 +1,70 @@
+#ifndef _POINT_FILTER_H_
+#define _POINT_FILTER_H_
+
+#include <omega.h>
+
+using namespace omega;
+
+///////////////////////////////////////////////////////////////////////////////
+// Point filter applied while decoding batches. A filter is a list of clauses
+// separated by '&', all of which must be true for a point to be kept. Each
+// clause compares a record field (x, y, z, r, g, b, a) to a constant using
+// <, <=, > or >=. For instance, points with red above 0.5 inside a clip
+// box on x and z:
+//     r>0.5&x>=-10&x<=10&z>=-10&z<=10
+// Filters can also be tested against batch bounds, to skip batches that
+// contain no matching points.
+class PointFilter
+{
+public:
+    PointFilter() {}
+
+    //! Parses a filter expression. Returns false (and leaves the filter
+    //! empty) if the expression is not valid.
+    bool parse(const String& expr);
+
+    bool empty() const { return myClauses.empty(); }
+
+    //! Returns true if a record (x, y, z, r, g, b, a) passes the filter.
+    template<typename T>
+    bool test(const T* record) const;
+
+    //! Returns true if any record with fields within the given bounds could
+    //! pass the filter. Bounds are in record field order. Bounds are widened
+    //! by the error of converting records to float and of bounds files
+    //! written at low precision, so this never returns false for batches
+    //! containing matching records.
+    bool mayMatch(const float* fieldmin, const float* fieldmax) const;
+
+private:
+    enum Op { Less, LessEqual, Greater, GreaterEqual };
+
+    struct Clause
+    {
+        int field;
+        Op op;
+        double value;
+    };
+
+    Vector<Clause> myClauses;
+};
+
+///////////////////////////////////////////////////////////////////////////////
+template<typename T>
+inline bool PointFilter::test(const T* record) const
+{
+    for(size_t i = 0; i < myClauses.size(); i++)
+    {
+        const Clause& c = myClauses[i];
+        double v = record[c.field];
+        switch(c.op)
+        {
+        case Less: if(!(v < c.value)) return false; break;
+        case LessEqual: if(!(v <= c.value)) return false; break;
+        case Greater: if(!(v > c.value)) return false; break;
+        case GreaterEqual: if(!(v >= c.value)) return false; break;
+        }
+    }
+    return true;
+}
+#endif
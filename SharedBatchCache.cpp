@@ -0,0 +1,704 @@
+#include "SharedBatchCache.h"
+
+#include <OpenThreads/Mutex>
+#include <OpenThreads/ScopedLock>
+#include <OpenThreads/Thread>
+
+#ifndef _WIN32
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <signal.h>
+#include <errno.h>
+#include <time.h>
+#endif
+
+using namespace omega;
+
+#define SHARED_BATCH_CACHE_MAGIC 0x50434243
+#define SHARED_BATCH_CACHE_VERSION 2
+// Publishing entries older than this (in seconds) belong to a process that
+// died while decoding, and can be reclaimed.
+#define SHARED_BATCH_CACHE_PUBLISH_TIMEOUT 30
+
+///////////////////////////////////////////////////////////////////////////////
+struct SharedBatchCache::Entry
+{
+    enum State { Free, Publishing, Ready };
+
+    uint64_t key;
+    uint64_t bytes;
+    uint64_t lastUse;
+    int64_t started;
+    int32_t refs;
+    int32_t state;
+    // References held by each process, so they can be dropped if the
+    // process dies.
+    int32_t slotRefs[SHARED_BATCH_CACHE_MAX_PROCESSES];
+};
+
+///////////////////////////////////////////////////////////////////////////////
+struct SharedBatchCache::Control
+{
+    volatile uint32_t magic;
+    uint32_t version;
+#ifndef _WIN32
+    pthread_mutex_t mutex;
+#endif
+    uint64_t budget;
+    uint64_t totalBytes;
+    uint64_t clock;
+    // Pids of the attached processes, 0 for free slots.
+    int32_t pids[SHARED_BATCH_CACHE_MAX_PROCESSES];
+    Entry entries[SHARED_BATCH_CACHE_MAX_ENTRIES];
+};
+
+// Batch segments start with a header followed by the point and color arrays.
+// The header size keeps the arrays 16 byte aligned.
+struct SegmentHeader
+{
+    uint32_t magic;
+    uint32_t numPoints;
+    uint32_t hiddenPoints;
+    uint32_t padding;
+};
+
+///////////////////////////////////////////////////////////////////////////////
+uint64_t SharedBatchCache::makeKey(const String& path, const String& batch)
+{
+    String id = path + "|" + batch;
+#ifndef _WIN32
+    struct stat st;
+    if(stat(path.c_str(), &st) == 0)
+    {
+        id = ostr("%1%|%2%|%3%", %id %st.st_size %st.st_mtime);
+    }
+#endif
+
+    // FNV-1a
+    uint64_t h = 14695981039346656037ULL;
+    for(size_t i = 0; i < id.size(); i++)
+    {
+        h ^= (unsigned char)id[i];
+        h *= 1099511628211ULL;
+    }
+    return h;
+}
+
+#ifdef _WIN32
+///////////////////////////////////////////////////////////////////////////////
+SharedBatchCache* SharedBatchCache::instance(size_t budgetMB, const String& name)
+{
+    static bool warned = false;
+    if(!warned)
+    {
+        owarn("SharedBatchCache: shared batch cache not supported on this platform");
+        warned = true;
+    }
+    return NULL;
+}
+SharedBatchCache::SharedBatchCache(Control* ctl, const String& name, int slot): myControl(ctl), myName(name), mySlot(slot) {}
+SharedBatchCache::Result SharedBatchCache::acquire(uint64_t, osg::ref_ptr<osg::Array>&, osg::ref_ptr<osg::Array>&, size_t*) { return Skip; }
+bool SharedBatchCache::publish(uint64_t, const osg::Vec3Array*, const osg::Vec4Array*, size_t, osg::ref_ptr<osg::Array>&, osg::ref_ptr<osg::Array>&) { return false; }
+void SharedBatchCache::abandon(uint64_t) {}
+SharedBatchCache::Stats SharedBatchCache::getStats() { return Stats(); }
+void SharedBatchCache::clear() {}
+#else
+
+///////////////////////////////////////////////////////////////////////////////
+// A mapped batch segment. The cache entry reference taken when the segment
+// was mapped is held until it is unmapped, so it can't be evicted meanwhile.
+class SharedBatchCache::Segment: public osg::Referenced
+{
+public:
+    Segment(SharedBatchCache* cache, Entry* entry, uint64_t key, void* memory, size_t size):
+        myCache(cache), myEntry(entry), myKey(key), myMemory(memory), mySize(size) {}
+
+    const SegmentHeader* getHeader() const { return (const SegmentHeader*)myMemory; }
+    const float* getPoints() const { return (const float*)(getHeader() + 1); }
+    const float* getColors() const { return getPoints() + getHeader()->numPoints * 3; }
+
+protected:
+    virtual ~Segment()
+    {
+        munmap(myMemory, mySize);
+        myCache->release(myEntry, myKey);
+    }
+
+private:
+    SharedBatchCache* myCache;
+    Entry* myEntry;
+    uint64_t myKey;
+    void* myMemory;
+    size_t mySize;
+};
+
+///////////////////////////////////////////////////////////////////////////////
+// Vertex or color array drawing a mapped batch segment in place. Segments are
+// mapped read-only: the array has a fixed size and cannot be modified. The
+// array keeps the segment mapped until it is deleted.
+class SharedBatchArray: public osg::Array
+{
+public:
+    SharedBatchArray(osg::Referenced* segment, const float* data, unsigned int numElements, int components):
+        osg::Array(osg::Array::ArrayType, components, GL_FLOAT),
+        mySegment(segment), myData(data), myNumElements(numElements)
+    {
+    }
+
+    // Clones are regular arrays.
+    virtual osg::Object* cloneType() const { return createArray(0); }
+    virtual osg::Object* clone(const osg::CopyOp&) const
+    {
+        osg::Array* a = createArray(myNumElements);
+        if(myNumElements > 0) memcpy((void*)a->getDataPointer(), myData, getTotalDataSize());
+        return a;
+    }
+    virtual bool isSameKindAs(const osg::Object* obj) const { return dynamic_cast<const SharedBatchArray*>(obj) != NULL; }
+    virtual const char* className() const { return "SharedBatchArray"; }
+
+    virtual void accept(osg::ArrayVisitor& av) { av.apply(*this); }
+    virtual void accept(osg::ConstArrayVisitor& av) const { av.apply(*this); }
+    // Values are copied, since visitors can modify them.
+    virtual void accept(unsigned int index, osg::ValueVisitor& vv)
+    {
+        if(getDataSize() == 3)
+        {
+            osg::Vec3f v = *(const osg::Vec3f*)element(index);
+            vv.apply(v);
+        }
+        else
+        {
+            osg::Vec4f v = *(const osg::Vec4f*)element(index);
+            vv.apply(v);
+        }
+    }
+    virtual void accept(unsigned int index, osg::ConstValueVisitor& vv) const
+    {
+        if(getDataSize() == 3) vv.apply(*(const osg::Vec3f*)element(index));
+        else vv.apply(*(const osg::Vec4f*)element(index));
+    }
+    virtual int compare(unsigned int lhs, unsigned int rhs) const
+    {
+        const float* l = element(lhs);
+        const float* r = element(rhs);
+        for(int i = 0; i < getDataSize(); i++)
+        {
+            if(l[i] < r[i]) return -1;
+            if(r[i] < l[i]) return 1;
+        }
+        return 0;
+    }
+
+    virtual const GLvoid* getDataPointer() const { return myNumElements > 0 ? myData : NULL; }
+    virtual const GLvoid* getDataPointer(unsigned int index) const { return element(index); }
+    virtual unsigned int getTotalDataSize() const { return myNumElements * getDataSize() * sizeof(float); }
+    virtual unsigned int getNumElements() const { return myNumElements; }
+    // The segment has a fixed size.
+    virtual void reserveArray(unsigned int) {}
+    virtual void resizeArray(unsigned int) {}
+
+private:
+    const float* element(unsigned int index) const { return myData + index * getDataSize(); }
+
+    osg::Array* createArray(unsigned int n) const
+    {
+        if(getDataSize() == 3) return new osg::Vec3Array(n);
+        return new osg::Vec4Array(n);
+    }
+
+    osg::ref_ptr<osg::Referenced> mySegment;
+    const float* myData;
+    unsigned int myNumElements;
+};
+
+///////////////////////////////////////////////////////////////////////////////
+SharedBatchCache* SharedBatchCache::instance(size_t budgetMB, const String& name)
+{
+    static OpenThreads::Mutex sInstanceLock;
+    static SharedBatchCache* sInstance = NULL;
+    static bool sFailed = false;
+
+    OpenThreads::ScopedLock<OpenThreads::Mutex> lock(sInstanceLock);
+    if(sInstance != NULL || sFailed) return sInstance;
+    sFailed = true;
+
+    // The first process on this host creates and initializes the index,
+    // the others wait for it to be ready.
+    bool creator = true;
+    int fd = shm_open(name.c_str(), O_RDWR | O_CREAT | O_EXCL, 0666);
+    if(fd < 0 && errno == EEXIST)
+    {
+        creator = false;
+        fd = shm_open(name.c_str(), O_RDWR, 0666);
+    }
+    if(fd < 0)
+    {
+        ofwarn("SharedBatchCache: could not open %1%: %2%", %name %strerror(errno));
+        return NULL;
+    }
+
+    if(creator && ftruncate(fd, sizeof(Control)) != 0)
+    {
+        ofwarn("SharedBatchCache: could not size %1%: %2%", %name %strerror(errno));
+        close(fd);
+        shm_unlink(name.c_str());
+        return NULL;
+    }
+
+    // Wait for the creator to size the segment.
+    struct stat st;
+    int wait = 0;
+    while(fstat(fd, &st) == 0 && (size_t)st.st_size < sizeof(Control) && wait < SHARED_BATCH_CACHE_WAIT)
+    {
+        OpenThreads::Thread::microSleep(1000);
+        wait++;
+    }
+    if((size_t)st.st_size < sizeof(Control))
+    {
+        ofwarn("SharedBatchCache: %1% is not initialized", %name);
+        close(fd);
+        return NULL;
+    }
+
+    void* mem = mmap(NULL, sizeof(Control), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if(mem == MAP_FAILED)
+    {
+        ofwarn("SharedBatchCache: could not map %1%: %2%", %name %strerror(errno));
+        return NULL;
+    }
+
+    Control* ctl = (Control*)mem;
+    if(creator)
+    {
+        pthread_mutexattr_t attr;
+        pthread_mutexattr_init(&attr);
+        pthread_mutexattr_setpshared(&attr, PTHREAD_PROCESS_SHARED);
+#ifdef __linux__
+        // Do not deadlock the host if a process dies holding the lock.
+        pthread_mutexattr_setrobust(&attr, PTHREAD_MUTEX_ROBUST);
+#endif
+        pthread_mutex_init(&ctl->mutex, &attr);
+        pthread_mutexattr_destroy(&attr);
+
+        ctl->version = SHARED_BATCH_CACHE_VERSION;
+        ctl->budget = (uint64_t)budgetMB * 1024 * 1024;
+        __sync_synchronize();
+        ctl->magic = SHARED_BATCH_CACHE_MAGIC;
+    }
+    else
+    {
+        wait = 0;
+        while(ctl->magic != SHARED_BATCH_CACHE_MAGIC && wait < SHARED_BATCH_CACHE_WAIT)
+        {
+            OpenThreads::Thread::microSleep(1000);
+            wait++;
+        }
+        __sync_synchronize();
+        if(ctl->magic != SHARED_BATCH_CACHE_MAGIC || ctl->version != SHARED_BATCH_CACHE_VERSION)
+        {
+            ofwarn("SharedBatchCache: %1% is not initialized or has a different version", 
+                %name);
+            munmap(mem, sizeof(Control));
+            return NULL;
+        }
+    }
+
+    SharedBatchCache* cache = new SharedBatchCache(ctl, name, -1);
+
+    // Take a slot in the process table, reclaiming the slots of processes
+    // that are gone.
+    cache->lock();
+    cache->reclaimDeadProcesses();
+    for(int i = 0; i < SHARED_BATCH_CACHE_MAX_PROCESSES && cache->mySlot < 0; i++)
+    {
+        if(ctl->pids[i] == 0)
+        {
+            ctl->pids[i] = getpid();
+            cache->mySlot = i;
+        }
+    }
+    cache->unlock();
+    if(cache->mySlot < 0)
+    {
+        ofwarn("SharedBatchCache: more than %1% processes attached to %2%", 
+            %SHARED_BATCH_CACHE_MAX_PROCESSES %name);
+        delete cache;
+        munmap(mem, sizeof(Control));
+        return NULL;
+    }
+
+    ofmsg("[SharedBatchCache] %1% host cache %2%, budget <%3%MB>", 
+        %(creator ? "created" : "attached to")
+        %name
+        %(ctl->budget / 1024 / 1024));
+
+    sFailed = false;
+    sInstance = cache;
+    return sInstance;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+SharedBatchCache::SharedBatchCache(Control* ctl, const String& name, int slot):
+    myControl(ctl),
+    myName(name),
+    mySlot(slot)
+{
+}
+
+///////////////////////////////////////////////////////////////////////////////
+void SharedBatchCache::lock()
+{
+    int r = pthread_mutex_lock(&myControl->mutex);
+#ifdef __linux__
+    if(r == EOWNERDEAD) pthread_mutex_consistent(&myControl->mutex);
+#endif
+}
+
+///////////////////////////////////////////////////////////////////////////////
+void SharedBatchCache::unlock()
+{
+    pthread_mutex_unlock(&myControl->mutex);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+String SharedBatchCache::getSegmentName(uint64_t key)
+{
+    // Batch segments are named after the index, so separate caches never
+    // share segments.
+    char suffix[32];
+    snprintf(suffix, 32, ".%016llx", (unsigned long long)key);
+    return myName + suffix;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+SharedBatchCache::Entry* SharedBatchCache::findEntry(uint64_t key)
+{
+    for(int i = 0; i < SHARED_BATCH_CACHE_MAX_ENTRIES; i++)
+    {
+        Entry* e = &myControl->entries[i];
+        if(e->state != Entry::Free && e->key == key) return e;
+    }
+    return NULL;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+void SharedBatchCache::removeEntry(Entry* e)
+{
+    if(e->state == Entry::Ready)
+    {
+        shm_unlink(getSegmentName(e->key).c_str());
+        myControl->totalBytes -= e->bytes;
+    }
+    memset(e, 0, sizeof(Entry));
+}
+
+///////////////////////////////////////////////////////////////////////////////
+void SharedBatchCache::evict()
+{
+    // Must be called with the lock held.
+    bool reclaimed = false;
+    while(myControl->totalBytes > myControl->budget)
+    {
+        Entry* lru = NULL;
+        for(int i = 0; i < SHARED_BATCH_CACHE_MAX_ENTRIES; i++)
+        {
+            Entry* e = &myControl->entries[i];
+            if(e->state == Entry::Ready && e->refs == 0 &&
+                (lru == NULL || e->lastUse < lru->lastUse)) lru = e;
+        }
+        if(lru == NULL)
+        {
+            // All batches are mapped. Batches mapped by dead processes can
+            // be evicted once their references are dropped.
+            if(reclaimed || !reclaimDeadProcesses()) break;
+            reclaimed = true;
+            continue;
+        }
+        removeEntry(lru);
+    }
+}
+
+///////////////////////////////////////////////////////////////////////////////
+bool SharedBatchCache::reclaimDeadProcesses()
+{
+    // Must be called with the lock held.
+    bool reclaimed = false;
+    for(int s = 0; s < SHARED_BATCH_CACHE_MAX_PROCESSES; s++)
+    {
+        pid_t pid = myControl->pids[s];
+        if(pid == 0 || kill(pid, 0) == 0 || errno != ESRCH) continue;
+
+        int refs = 0;
+        for(int i = 0; i < SHARED_BATCH_CACHE_MAX_ENTRIES; i++)
+        {
+            Entry* e = &myControl->entries[i];
+            refs += e->slotRefs[s];
+            e->refs -= e->slotRefs[s];
+            e->slotRefs[s] = 0;
+        }
+        myControl->pids[s] = 0;
+        reclaimed = true;
+        if(refs > 0)
+        {
+            ofmsg("[SharedBatchCache] released %1% batch references held by dead process %2%", 
+                %refs %pid);
+        }
+    }
+    return reclaimed;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+void SharedBatchCache::addRef(Entry* e)
+{
+    // Must be called with the lock held.
+    e->refs++;
+    e->slotRefs[mySlot]++;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+void SharedBatchCache::release(Entry* e, uint64_t key)
+{
+    lock();
+    if(e->key == key && e->slotRefs[mySlot] > 0)
+    {
+        e->refs--;
+        e->slotRefs[mySlot]--;
+    }
+    // Evictions may have been held back by this batch being mapped.
+    evict();
+    unlock();
+}
+
+///////////////////////////////////////////////////////////////////////////////
+SharedBatchCache::Result SharedBatchCache::acquire(uint64_t key, 
+    osg::ref_ptr<osg::Array>& points, osg::ref_ptr<osg::Array>& colors, size_t* hiddenPoints)
+{
+    int wait = 0;
+    while(true)
+    {
+        lock();
+        Entry* e = findEntry(key);
+        if(e == NULL)
+        {
+            // Reserve an entry: this process will publish the batch.
+            Entry* lru = NULL;
+            for(int i = 0; i < SHARED_BATCH_CACHE_MAX_ENTRIES && e == NULL; i++)
+            {
+                Entry* f = &myControl->entries[i];
+                if(f->state == Entry::Free) e = f;
+                else if(f->state == Entry::Ready && f->refs == 0 &&
+                    (lru == NULL || f->lastUse < lru->lastUse)) lru = f;
+            }
+            // Index full: reuse the least recently used entry.
+            if(e == NULL && lru != NULL)
+            {
+                removeEntry(lru);
+                e = lru;
+            }
+            if(e == NULL)
+            {
+                unlock();
+                return Skip;
+            }
+            e->key = key;
+            e->state = Entry::Publishing;
+            e->started = time(NULL);
+            e->lastUse = ++myControl->clock;
+            unlock();
+            return Publish;
+        }
+
+        if(e->state == Entry::Publishing)
+        {
+            // Another process is decoding this batch. If it has been at it
+            // for too long it probably died: take over.
+            if(time(NULL) - e->started > SHARED_BATCH_CACHE_PUBLISH_TIMEOUT)
+            {
+                e->started = time(NULL);
+                unlock();
+                return Publish;
+            }
+            unlock();
+            if(wait >= SHARED_BATCH_CACHE_WAIT) return Skip;
+            OpenThreads::Thread::microSleep(5000);
+            wait += 5;
+            continue;
+        }
+
+        // Ready: the reference is held by the mapping from now on, so the
+        // batch is not evicted while it is in use.
+        addRef(e);
+        e->lastUse = ++myControl->clock;
+        unlock();
+
+        if(mapSegment(e, key, points, colors, hiddenPoints)) return Hit;
+
+        // The segment is missing or corrupt: drop it.
+        lock();
+        if(e->key == key && e->slotRefs[mySlot] > 0)
+        {
+            e->refs--;
+            e->slotRefs[mySlot]--;
+            if(e->refs == 0) removeEntry(e);
+        }
+        unlock();
+        return Skip;
+    }
+}
+
+///////////////////////////////////////////////////////////////////////////////
+bool SharedBatchCache::mapSegment(Entry* e, uint64_t key, 
+    osg::ref_ptr<osg::Array>& points, osg::ref_ptr<osg::Array>& colors, size_t* hiddenPoints)
+{
+    int fd = shm_open(getSegmentName(key).c_str(), O_RDONLY, 0);
+    if(fd < 0) return false;
+
+    struct stat st;
+    if(fstat(fd, &st) != 0 || (size_t)st.st_size < sizeof(SegmentHeader))
+    {
+        close(fd);
+        return false;
+    }
+
+    void* mem = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if(mem == MAP_FAILED) return false;
+
+    const SegmentHeader* h = (const SegmentHeader*)mem;
+    size_t n = h->numPoints;
+    size_t size = sizeof(SegmentHeader) + n * (sizeof(osg::Vec3f) + sizeof(osg::Vec4f));
+    if(h->magic != SHARED_BATCH_CACHE_MAGIC || (size_t)st.st_size < size || h->hiddenPoints > n)
+    {
+        munmap(mem, st.st_size);
+        return false;
+    }
+
+    osg::ref_ptr<Segment> segment = new Segment(this, e, key, mem, st.st_size);
+    points = new SharedBatchArray(segment.get(), segment->getPoints(), n, 3);
+    colors = new SharedBatchArray(segment.get(), segment->getColors(), n, 4);
+    *hiddenPoints = h->hiddenPoints;
+    return true;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+bool SharedBatchCache::publish(uint64_t key, const osg::Vec3Array* points, const osg::Vec4Array* colors,
+    size_t hiddenPoints, osg::ref_ptr<osg::Array>& sharedPoints, osg::ref_ptr<osg::Array>& sharedColors)
+{
+    size_t n = points->size();
+    size_t size = sizeof(SegmentHeader) + n * (sizeof(osg::Vec3f) + sizeof(osg::Vec4f));
+    String name = getSegmentName(key);
+
+    // Remove leftovers from a process that died while publishing.
+    shm_unlink(name.c_str());
+    int fd = shm_open(name.c_str(), O_RDWR | O_CREAT | O_EXCL, 0666);
+    if(fd < 0)
+    {
+        abandon(key);
+        return false;
+    }
+    void* mem = MAP_FAILED;
+    if(ftruncate(fd, size) == 0)
+    {
+        mem = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    }
+    close(fd);
+    if(mem == MAP_FAILED)
+    {
+        ofwarn("SharedBatchCache: could not publish %1% (%2% bytes): %3%", %name %size %strerror(errno));
+        shm_unlink(name.c_str());
+        abandon(key);
+        return false;
+    }
+
+    SegmentHeader* h = (SegmentHeader*)mem;
+    h->magic = SHARED_BATCH_CACHE_MAGIC;
+    h->numPoints = n;
+    h->hiddenPoints = hiddenPoints;
+    if(n > 0)
+    {
+        char* data = (char*)mem + sizeof(SegmentHeader);
+        memcpy(data, &(*points)[0], n * sizeof(osg::Vec3f));
+        memcpy(data + n * sizeof(osg::Vec3f), &(*colors)[0], n * sizeof(osg::Vec4f));
+    }
+    // The publisher draws the batch from the segment too.
+    mprotect(mem, size, PROT_READ);
+
+    lock();
+    Entry* e = findEntry(key);
+    bool published = (e != NULL && e->state == Entry::Publishing);
+    if(published)
+    {
+        e->state = Entry::Ready;
+        e->bytes = size;
+        e->lastUse = ++myControl->clock;
+        myControl->totalBytes += size;
+        addRef(e);
+        evict();
+    }
+    else
+    {
+        // Our reservation was taken over: drop the segment.
+        shm_unlink(name.c_str());
+    }
+    unlock();
+
+    if(!published)
+    {
+        munmap(mem, size);
+        return false;
+    }
+
+    osg::ref_ptr<Segment> segment = new Segment(this, e, key, mem, size);
+    sharedPoints = new SharedBatchArray(segment.get(), segment->getPoints(), n, 3);
+    sharedColors = new SharedBatchArray(segment.get(), segment->getColors(), n, 4);
+    return true;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+void SharedBatchCache::abandon(uint64_t key)
+{
+    lock();
+    Entry* e = findEntry(key);
+    if(e != NULL && e->state == Entry::Publishing) removeEntry(e);
+    unlock();
+}
+
+///////////////////////////////////////////////////////////////////////////////
+SharedBatchCache::Stats SharedBatchCache::getStats()
+{
+    Stats s;
+    lock();
+    reclaimDeadProcesses();
+    s.budget = myControl->budget;
+    s.totalBytes = myControl->totalBytes;
+    for(int i = 0; i < SHARED_BATCH_CACHE_MAX_ENTRIES; i++)
+    {
+        Entry* e = &myControl->entries[i];
+        if(e->state == Entry::Ready) s.readyBatches++;
+        else if(e->state == Entry::Publishing) s.publishingBatches++;
+        s.refs += e->refs;
+    }
+    for(int i = 0; i < SHARED_BATCH_CACHE_MAX_PROCESSES; i++)
+    {
+        if(myControl->pids[i] != 0) s.processes++;
+    }
+    unlock();
+    return s;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+void SharedBatchCache::clear()
+{
+    lock();
+    for(int i = 0; i < SHARED_BATCH_CACHE_MAX_ENTRIES; i++)
+    {
+        Entry* e = &myControl->entries[i];
+        if(e->state == Entry::Ready && e->refs == 0) removeEntry(e);
+    }
+    unlock();
+}
+#endif
@@ -0,0 +1,122 @@
+#ifndef _SHARED_BATCH_CACHE_H_
+#define _SHARED_BATCH_CACHE_H_
+
+#include <omega.h>
+
+// OSG
+#include <osg/Array>
+
+#include <stdint.h>
+
+using namespace omega;
+
+// Name of the shared memory segment holding the cache index. Batch segments
+// are named after it.
+#define SHARED_BATCH_CACHE_NAME "/pointCloud.cache"
+// Maximum number of batches the shared cache can index.
+#define SHARED_BATCH_CACHE_MAX_ENTRIES 4096
+// Maximum number of processes attached to the cache at the same time.
+#define SHARED_BATCH_CACHE_MAX_PROCESSES 32
+// How long to wait for a batch being published by another process before
+// decoding it locally, in milliseconds.
+#define SHARED_BATCH_CACHE_WAIT 2000
+
+///////////////////////////////////////////////////////////////////////////////
+// Host-wide cache of decoded point batches, backed by POSIX shared memory.
+// When several render processes on the same host page the same dataset, the
+// first process to need a batch decodes it and publishes it in its own shared
+// memory segment. All processes, including the publisher, then draw the batch
+// from read-only arrays mapping the segment, so each batch is held in memory
+// once per host.
+// An index segment shared by all processes keeps track of published batches,
+// with a reference count for every mapping of them. Mapped batches are never
+// evicted: when the total size of published batches goes over budget, the
+// least recently used unmapped batches are. References held by processes
+// that died are reclaimed.
+class SharedBatchCache
+{
+public:
+    struct Stats
+    {
+        Stats(): budget(0), totalBytes(0), readyBatches(0), publishingBatches(0), refs(0), processes(0) {}
+        // Size budget and total size of published batches, in bytes.
+        uint64_t budget;
+        uint64_t totalBytes;
+        // Number of published batches / batches being decoded.
+        int readyBatches;
+        int publishingBatches;
+        // Sum of the reference counts of all batches. Should be 0 when no
+        // process has batches mapped.
+        int refs;
+        // Number of processes attached to the cache.
+        int processes;
+    };
+
+    enum Result
+    {
+        // Batch found and mapped into the output arrays.
+        Hit,
+        // Batch not found: the caller must decode it and then call publish()
+        // or abandon().
+        Publish,
+        // Batch not available: the caller should decode it without publishing.
+        Skip
+    };
+
+    //! Returns the cache for this process, attaching to the host cache (or
+    //! creating it with the given budget) the first time it is called.
+    //! Returns NULL if shared memory is not available. The name of the
+    //! index segment can be changed to run separate caches on the same host.
+    static SharedBatchCache* instance(size_t budgetMB, const String& name = SHARED_BATCH_CACHE_NAME);
+
+    //! Returns the key identifying a batch of a data file. The key includes
+    //! the size and modification time of the file, so batches of a file
+    //! that changed are never returned.
+    static uint64_t makeKey(const String& path, const String& batch);
+
+    //! Looks a batch up. On a hit, points and colors are read-only float
+    //! arrays mapping the batch segment, and hiddenPoints is the number of
+    //! points at the end of the batch hidden by the sphere filter. The batch
+    //! stays in the cache as long as the arrays are alive.
+    Result acquire(uint64_t key, osg::ref_ptr<osg::Array>& points, osg::ref_ptr<osg::Array>& colors,
+        size_t* hiddenPoints);
+    //! Publishes a batch reserved by acquire. On success, returns true and
+    //! sets sharedPoints and sharedColors to arrays mapping the published
+    //! batch, so the caller can drop its own copy.
+    bool publish(uint64_t key, const osg::Vec3Array* points, const osg::Vec4Array* colors,
+        size_t hiddenPoints, osg::ref_ptr<osg::Array>& sharedPoints, osg::ref_ptr<osg::Array>& sharedColors);
+    //! Releases a batch reserved by acquire, i.e. if it could not be decoded.
+    void abandon(uint64_t key);
+
+    //! Returns statistics for the whole host cache.
+    Stats getStats();
+    //! Removes all the published batches that are not mapped.
+    void clear();
+
+private:
+    struct Control;
+    struct Entry;
+    class Segment;
+    friend class Segment;
+
+    SharedBatchCache(Control* ctl, const String& name, int slot);
+
+    void lock();
+    void unlock();
+    Entry* findEntry(uint64_t key);
+    void removeEntry(Entry* e);
+    void evict();
+    bool reclaimDeadProcesses();
+    void addRef(Entry* e);
+    void release(Entry* e, uint64_t key);
+    String getSegmentName(uint64_t key);
+    bool mapSegment(Entry* e, uint64_t key,
+        osg::ref_ptr<osg::Array>& points, osg::ref_ptr<osg::Array>& colors, size_t* hiddenPoints);
+
+private:
+    Control* myControl;
+    String myName;
+    // Index of this process in the control block process table
+    int mySlot;
+};
+#endif
@@ -0,0 +1,293 @@
+#include "SphereArrayFilter.h"
+#include "PointArrayPool.h"
+
+#include <osg/Group>
+#include <OpenThreads/ScopedLock>
+
+#include <algorithm>
+#include <limits>
+
+using namespace omega;
+
+// Bits per axis in cell keys
+#define CELL_BITS 21
+// Marks empty slots in the cell table
+#define EMPTY_CELL (~0ULL)
+
+volatile bool SphereArrayFilter::sEnabled = true;
+OpenThreads::Mutex SphereArrayFilter::sStatsLock;
+SphereArrayFilter::Stats SphereArrayFilter::sStats;
+
+///////////////////////////////////////////////////////////////////////////////
+// Open addressing hash set of cell keys. Each cell stores the number of axes
+// along which its neighbourhood has been found fully occupied. The table
+// works on memory provided by the caller (see getSize), so batches can use
+// pooled scratch buffers.
+class CellTable
+{
+public:
+    //! Returns the number of slots of a table for up to numKeys keys.
+    static size_t getSize(size_t numKeys)
+    {
+        size_t size = 16;
+        while(size < numKeys * 2) size *= 2;
+        return size;
+    }
+
+    //! keys and levels hold getSize(numKeys) slots, cells numKeys entries.
+    CellTable(size_t numKeys, uint64_t* keys, unsigned char* levels, size_t* cells):
+        myKeys(keys), myLevels(levels), myCells(cells), myNumCells(0)
+    {
+        size_t size = getSize(numKeys);
+        myMask = size - 1;
+        std::fill(myKeys, myKeys + size, EMPTY_CELL);
+        memset(myLevels, 0, size);
+    }
+
+    //! Inserts a key if needed, returns its slot. New slots are appended
+    //! to the cells list.
+    size_t insert(uint64_t key)
+    {
+        size_t slot = hash(key);
+        while(myKeys[slot] != EMPTY_CELL && myKeys[slot] != key) slot = (slot + 1) & myMask;
+        if(myKeys[slot] == EMPTY_CELL)
+        {
+            myKeys[slot] = key;
+            myCells[myNumCells++] = slot;
+        }
+        return slot;
+    }
+
+    //! Returns the level of the cell with the given key, -1 if it is not
+    //! occupied.
+    int find(uint64_t key) const
+    {
+        size_t slot = hash(key);
+        while(myKeys[slot] != EMPTY_CELL)
+        {
+            if(myKeys[slot] == key) return myLevels[slot];
+            slot = (slot + 1) & myMask;
+        }
+        return -1;
+    }
+
+    uint64_t key(size_t slot) const { return myKeys[slot]; }
+    unsigned char& level(size_t slot) { return myLevels[slot]; }
+    //! Returns the slots of the occupied cells, in insertion order.
+    const size_t* cells() const { return myCells; }
+    size_t numCells() const { return myNumCells; }
+
+private:
+    size_t hash(uint64_t key) const
+    {
+        key ^= key >> 33;
+        key *= 0xff51afd7ed558ccdULL;
+        key ^= key >> 33;
+        return (size_t)key & myMask;
+    }
+
+    size_t myMask;
+    uint64_t* myKeys;
+    unsigned char* myLevels;
+    size_t* myCells;
+    size_t myNumCells;
+};
+
+///////////////////////////////////////////////////////////////////////////////
+static inline uint64_t cellKey(uint64_t i, uint64_t j, uint64_t k)
+{
+    return (i << (2 * CELL_BITS)) | (j << CELL_BITS) | k;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Shows or hides the hidden points child of a batch, following the filter
+// enabled flag.
+class SphereFilterSwitch: public osg::NodeCallback
+{
+public:
+    virtual void operator()(osg::Node* node, osg::NodeVisitor* nv)
+    {
+        osg::Group* group = node->asGroup();
+        if(group != NULL && group->getNumChildren() > 1)
+        {
+            group->getChild(1)->setNodeMask(SphereArrayFilter::isEnabled() ? 0 : ~0);
+        }
+        traverse(node, nv);
+    }
+};
+
+///////////////////////////////////////////////////////////////////////////////
+SphereArrayFilter::SphereArrayFilter(float radius)
+{
+    // A view ray crossing a cell at (x, z) relative to a point in the cell
+    // (z towards the eye) hits its splat at a depth of at least z if
+    // (|x| + |z| T)^2 + (z r / depth)^2 <= r^2, for rays within T of the view
+    // direction. The largest cell diagonal L satisfying this for any
+    // |x|^2 + z^2 <= L^2 is r / sqrt(l), l being the largest eigenvalue of
+    // [[1, T], [T, T^2 + k^2]] (k = r / depth), or 1 + T^2 for z < 0.
+    float t2 = SPHERE_ARRAY_FILTER_MAX_RAY_TAN * SPHERE_ARRAY_FILTER_MAX_RAY_TAN;
+    float k2 = 1.0f / (SPHERE_ARRAY_FILTER_DEPTH_SCALE * SPHERE_ARRAY_FILTER_DEPTH_SCALE);
+    float a = 1.0f + t2 + k2;
+    float l = (a + sqrtf(a * a - 4.0f * k2)) / 2.0f;
+    if(l < 1.0f + t2) l = 1.0f + t2;
+    myCellSize = radius / sqrtf(l) / sqrtf(3.0f);
+
+    // Before reaching a splat fragment, a ray crosses the splat footprint
+    // (radius r) and then moves towards the eye by up to depth, drifting
+    // sideways by up to depth * T. All cells it may cross meanwhile must be
+    // occupied for the splat to be hidden.
+    float depth = radius * SPHERE_ARRAY_FILTER_DEPTH_SCALE;
+    float reach = radius + depth * SPHERE_ARRAY_FILTER_MAX_RAY_TAN;
+    myRange = radius > 0 ? (int)ceilf(sqrtf(reach * reach + depth * depth) / myCellSize) : 0;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+size_t SphereArrayFilter::apply(osg::Vec3Array* points, osg::Vec4Array* colors)
+{
+    size_t n = points->size();
+    if(n == 0 || myCellSize <= 0) return 0;
+
+    osg::Vec3f pmin(std::numeric_limits<float>::max(), std::numeric_limits<float>::max(), std::numeric_limits<float>::max());
+    osg::Vec3f pmax = -pmin;
+    for(size_t i = 0; i < n; i++)
+    {
+        const osg::Vec3f& p = (*points)[i];
+        for(int j = 0; j < 3; j++)
+        {
+            if(p[j] < pmin[j]) pmin[j] = p[j];
+            if(p[j] > pmax[j]) pmax[j] = p[j];
+        }
+    }
+
+    // Keep a margin of myRange empty cells around the points, so neighbour
+    // lookups never wrap around.
+    const int64_t maxCell = (1 << CELL_BITS) - 1 - 2 * myRange;
+    for(int j = 0; j < 3; j++)
+    {
+        if((pmax[j] - pmin[j]) / myCellSize >= maxCell)
+        {
+            // Cells are too small for this batch: it is very sparse compared
+            // to the sphere size, nothing would be hidden anyway.
+            return 0;
+        }
+    }
+
+    // All scratch memory comes from one pooled buffer: point keys, the cell
+    // table, the occupied cells list and the hidden points staging arrays.
+    size_t tableSize = CellTable::getSize(n);
+    size_t scratchSize = n * sizeof(uint64_t) + tableSize * sizeof(uint64_t) + n * sizeof(size_t) +
+        n * (sizeof(osg::Vec3f) + sizeof(osg::Vec4f)) + tableSize;
+    PointArrayPool* pool = PointArrayPool::instance();
+    char* scratch = (char*)pool->getBuffer(scratchSize);
+    if(scratch == NULL)
+    {
+        ofwarn("SphereArrayFilter::apply: could not allocate %1% bytes", %scratchSize);
+        return 0;
+    }
+    uint64_t* keys = (uint64_t*)scratch;
+    uint64_t* tableKeys = keys + n;
+    size_t* tableCells = (size_t*)(tableKeys + tableSize);
+    osg::Vec3f* hiddenPoints = (osg::Vec3f*)(tableCells + n);
+    osg::Vec4f* hiddenColors = (osg::Vec4f*)(hiddenPoints + n);
+    unsigned char* tableLevels = (unsigned char*)(hiddenColors + n);
+
+    CellTable cells(n, tableKeys, tableLevels, tableCells);
+    for(size_t i = 0; i < n; i++)
+    {
+        const osg::Vec3f& p = (*points)[i];
+        uint64_t ci = (uint64_t)((p[0] - pmin[0]) / myCellSize) + myRange;
+        uint64_t cj = (uint64_t)((p[1] - pmin[1]) / myCellSize) + myRange;
+        uint64_t ck = (uint64_t)((p[2] - pmin[2]) / myCellSize) + myRange;
+        keys[i] = cellKey(ci, cj, ck);
+        cells.insert(keys[i]);
+    }
+
+    // Erode the occupied cells by a box of myRange cells, one axis at a time:
+    // after pass p, a cell has level p if all cells within myRange along the
+    // first p axes of it have level p - 1. Cells reaching level 3 have their
+    // whole neighbourhood occupied.
+    const size_t* occupied = cells.cells();
+    size_t numOccupied = cells.numCells();
+    for(int axis = 0; axis < 3; axis++)
+    {
+        int shift = (2 - axis) * CELL_BITS;
+        for(size_t c = 0; c < numOccupied; c++)
+        {
+            size_t slot = occupied[c];
+            if(cells.level(slot) != axis) continue;
+            uint64_t key = cells.key(slot);
+            bool full = true;
+            for(int64_t d = -myRange; d <= myRange && full; d++)
+            {
+                if(d == 0) continue;
+                // Keys never carry between axes thanks to the margin.
+                uint64_t neighbour = key + (uint64_t)(d * ((int64_t)1 << shift));
+                if(cells.find(neighbour) < axis) full = false;
+            }
+            if(full) cells.level(slot) = axis + 1;
+        }
+    }
+
+    // Move hidden points to the end of the arrays, keeping the order of
+    // visible points.
+    size_t kept = 0;
+    size_t hidden = 0;
+    for(size_t i = 0; i < n; i++)
+    {
+        if(cells.find(keys[i]) == 3)
+        {
+            hiddenPoints[hidden] = (*points)[i];
+            hiddenColors[hidden] = (*colors)[i];
+            hidden++;
+        }
+        else
+        {
+            if(kept != i)
+            {
+                (*points)[kept] = (*points)[i];
+                (*colors)[kept] = (*colors)[i];
+            }
+            kept++;
+        }
+    }
+    for(size_t i = 0; i < hidden; i++)
+    {
+        (*points)[kept + i] = hiddenPoints[i];
+        (*colors)[kept + i] = hiddenColors[i];
+    }
+    pool->releaseBuffer(scratch);
+
+    {
+        OpenThreads::ScopedLock<OpenThreads::Mutex> lock(sStatsLock);
+        sStats.batches++;
+        sStats.inputPoints += n;
+        sStats.hiddenPoints += hidden;
+    }
+    return hidden;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+void SphereArrayFilter::setEnabled(bool enabled)
+{
+    sEnabled = enabled;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+bool SphereArrayFilter::isEnabled()
+{
+    return sEnabled;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+osg::NodeCallback* SphereArrayFilter::getSwitchCallback()
+{
+    static osg::ref_ptr<osg::NodeCallback> sSwitch = new SphereFilterSwitch();
+    return sSwitch.get();
+}
+
+///////////////////////////////////////////////////////////////////////////////
+SphereArrayFilter::Stats SphereArrayFilter::getStats()
+{
+    OpenThreads::ScopedLock<OpenThreads::Mutex> lock(sStatsLock);
+    return sStats;
+}
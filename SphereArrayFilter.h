@@ -0,0 +1,77 @@
+#ifndef _SPHERE_ARRAY_FILTER_H_
+#define _SPHERE_ARRAY_FILTER_H_
+
+#include <omega.h>
+
+// OSG
+#include <osg/Array>
+#include <osg/NodeCallback>
+#include <OpenThreads/Mutex>
+
+using namespace omega;
+
+// How far splats extend towards the eye, as a multiple of their radius.
+// Sphere.geom draws quads pointScale wide, and Sphere.frag offsets their
+// depth by up to sphere_radius = 2 * pointScale.
+#define SPHERE_ARRAY_FILTER_DEPTH_SCALE 2.0f
+// Largest tangent of the angle between view rays and the view direction
+// for which hidden points are guaranteed to stay hidden. 1 covers fields of
+// view up to 90 degrees (measured on the diagonal).
+#define SPHERE_ARRAY_FILTER_MAX_RAY_TAN 1.0f
+
+///////////////////////////////////////////////////////////////////////////////
+// Finds points whose sphere splats are completely hidden by their neighbours
+// when rendered with the sphere shaders at a given radius (the pointScale
+// shader uniform).
+// Splats are view aligned discs of the given radius, whose depth extends
+// towards the eye by SPHERE_ARRAY_FILTER_DEPTH_SCALE times the radius.
+// Points are hashed into a grid of cells small enough that any view ray
+// crossing a cell hits the splat of any point in that cell no later than the
+// ray leaves the cell. A cell is hidden when all cells within the distance
+// a splat can extend to (plus the cell size) are occupied: a ray from
+// outside the point cloud always crosses a cell that is not hidden before
+// reaching any fragment of its splats, and that cell's splats are nearer.
+// This holds for opaque splats (globalAlpha = 1), view rays within
+// SPHERE_ARRAY_FILTER_MAX_RAY_TAN of the view direction and an eye that is
+// not inside a dense region.
+// The filter only sees the points of one batch, so it is conservative at
+// batch borders.
+class SphereArrayFilter
+{
+public:
+    struct Stats
+    {
+        Stats(): batches(0), inputPoints(0), hiddenPoints(0) {}
+        size_t batches;
+        size_t inputPoints;
+        size_t hiddenPoints;
+    };
+
+    SphereArrayFilter(float radius);
+
+    //! Moves hidden points to the end of points and colors, keeping the
+    //! order of the other points. Returns the number of hidden points.
+    size_t apply(osg::Vec3Array* points, osg::Vec4Array* colors);
+
+    //! Hidden points are only hidden by opaque splats: disable the filter
+    //! when drawing point clouds with globalAlpha below 1, to draw them
+    //! again. Enabled by default.
+    static void setEnabled(bool enabled);
+    static bool isEnabled();
+
+    //! Returns an update callback that shows the hidden points child of a
+    //! batch (child 1) when the filter is disabled.
+    static osg::NodeCallback* getSwitchCallback();
+
+    //! Returns totals for all the batches filtered so far.
+    static Stats getStats();
+
+private:
+    float myCellSize;
+    int myRange;
+
+    static volatile bool sEnabled;
+    static OpenThreads::Mutex sStatsLock;
+    static Stats sStats;
+};
+#endif
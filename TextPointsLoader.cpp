@@ -2,6 +2,14 @@
 
 #include <osg/Geode>
 #include <osg/Point>
+#include <osgDB/FileUtils>
+
+#include <sys/stat.h>
+#ifdef _WIN32
+#include <process.h>
+#else
+#include <unistd.h>
+#endif
 
 using namespace omega;
 using namespace cyclops;
@@ -9,6 +17,7 @@ using namespace cyclops;
 ///////////////////////////////////////////////////////////////////////////////
 TextPointsLoader::TextPointsLoader(): ModelLoader("points-text")
 {
+    myBinaryLoader = new BinaryPointsLoader();
 }
 
 ///////////////////////////////////////////////////////////////////////////////
@@ -26,6 +35,45 @@ bool TextPointsLoader::supportsExtension(const String& ext)
 ///////////////////////////////////////////////////////////////////////////////
 bool TextPointsLoader::load(ModelAsset* model)
 {
+    // Unless disabled, load a binary copy of the file through the binary
+    // loader, to get paging, batches and LOD. The copy is created the first
+    // time a file is loaded, and rebuilt when the file changes.
+    String path;
+    String cachePath;
+    if(model->info->options != "nocache" && 
+        DataManager::findFile(model->info->path, path) &&
+        getBinaryCache(path, cachePath))
+    {
+        ModelInfo* info = model->info;
+        String textPath = info->path;
+        String textOptions = info->options;
+
+        // Pass the copy to the binary loader by its path relative to the
+        // data sources, like the text file. The resolved path includes the
+        // data source prefix, which may contain dots.
+        String basename;
+        String extension;
+        String dir;
+        StringUtils::splitFullFilename(textPath, basename, extension, dir);
+        info->path = dir + "cache/" + basename + ".xyzb";
+        // Options meant for the text loader are not valid binary loader
+        // options: use the defaults then.
+        if(!BinaryPointsLoader::checkOptions(info->options))
+        {
+            if(!info->options.empty())
+            {
+                ofwarn("TextPointsLoader: ignoring options %1%, using %2%", 
+                    %info->options %TEXT_POINTS_DEFAULT_OPTIONS);
+            }
+            info->options = TEXT_POINTS_DEFAULT_OPTIONS;
+        }
+        bool result = myBinaryLoader->load(model);
+
+        info->path = textPath;
+        info->options = textOptions;
+        return result;
+    }
+
     osg::ref_ptr<osg::Group> group = new osg::Group();
 
 	bool result = loadFile(model->info->path, model->info->options, group);
@@ -128,3 +176,176 @@ void TextPointsLoader::readXYZ(
 	ifs.close();
 }
 
+
+///////////////////////////////////////////////////////////////////////////////
+// Returns a temporary file suffix unique to this process across hosts.
+static String getTempSuffix()
+{
+#ifdef _WIN32
+    const char* host = getenv("COMPUTERNAME");
+    int pid = _getpid();
+#else
+    char host[256];
+    if(gethostname(host, 256) != 0) strcpy(host, "localhost");
+    host[255] = '\0';
+    int pid = getpid();
+#endif
+    return ostr(".%1%.%2%.tmp", %(host != NULL ? host : "localhost") %pid);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+bool TextPointsLoader::getBinaryCache(const String& path, String& cachePath)
+{
+    // The binary copy of [path]/name.xyz is [path]/cache/name.xyzb. A
+    // [path]/cache/name.meta file identifies the source it was created from.
+    String basename;
+    String extension;
+    String dir;
+    StringUtils::splitFullFilename(path, basename, extension, dir);
+
+    String cacheDir = dir + "cache/";
+    cachePath = cacheDir + basename + ".xyzb";
+    String metaPath = cacheDir + basename + ".meta";
+
+    struct stat st;
+    if(stat(path.c_str(), &st) != 0) return false;
+    String meta = ostr("%1%\n%2%\n%3%\n", %path %st.st_size %st.st_mtime);
+
+    String found;
+    if(DataManager::findFile(metaPath, found) && DataManager::findFile(cachePath, found))
+    {
+        String currentMeta = DataManager::readTextFile(metaPath);
+        if(StringUtils::startsWith(currentMeta, meta)) return true;
+        ofmsg("[TextPointsLoader] %1% changed, rebuilding binary cache", %path);
+    }
+
+    DataManager::createPath(cacheDir + "bounds");
+
+    // Cluster nodes often load the same file from a shared filesystem at the
+    // same time. Each process converts to its own temporary file, and
+    // replaces the copy and its meta file atomically, so other processes only
+    // ever see complete files.
+    String tmpSuffix = getTempSuffix();
+
+    String tmpPath = cachePath + tmpSuffix;
+    size_t numRecords = 0;
+    if(!convertToBinary(path, tmpPath, &numRecords))
+    {
+        remove(tmpPath.c_str());
+        return false;
+    }
+#ifdef _WIN32
+    // rename does not replace existing files on Windows.
+    remove(cachePath.c_str());
+#endif
+    if(rename(tmpPath.c_str(), cachePath.c_str()) != 0)
+    {
+        ofwarn("TextPointsLoader: could not create %1%", %cachePath);
+        remove(tmpPath.c_str());
+        return false;
+    }
+
+    // Batch bounds computed for the previous version of the file are stale.
+    // They are recomputed by the binary loader on the next load. Bounds are
+    // removed after replacing the copy, so bounds computed from the old copy
+    // in the meantime are removed too.
+    osgDB::DirectoryContents bounds = osgDB::getDirectoryContents(cacheDir + "bounds");
+    foreach(String f, bounds)
+    {
+        if(StringUtils::startsWith(f, basename + ".") && StringUtils::endsWith(f, ".bounds"))
+        {
+            remove((cacheDir + "bounds/" + f).c_str());
+        }
+    }
+
+    // If the file changed while it was converted, the copy may mix old and
+    // new data: do not record it as up to date, so it is converted again.
+    struct stat st2;
+    if(stat(path.c_str(), &st2) != 0 || st2.st_size != st.st_size || st2.st_mtime != st.st_mtime)
+    {
+        ofwarn("TextPointsLoader: %1% changed while converting it", %path);
+        return true;
+    }
+
+    String tmpMetaPath = metaPath + tmpSuffix;
+    FILE* mf = fopen(tmpMetaPath.c_str(), "w");
+    if(mf == NULL)
+    {
+        ofwarn("TextPointsLoader: could not write %1%", %metaPath);
+        return true;
+    }
+    fprintf(mf, "%s%lu\n", meta.c_str(), (unsigned long)numRecords);
+    bool metaWritten = (fclose(mf) == 0);
+#ifdef _WIN32
+    remove(metaPath.c_str());
+#endif
+    if(!metaWritten || rename(tmpMetaPath.c_str(), metaPath.c_str()) != 0)
+    {
+        ofwarn("TextPointsLoader: could not write %1%", %metaPath);
+        remove(tmpMetaPath.c_str());
+    }
+
+    ofmsg("[TextPointsLoader] converted %1% (%2% points) to %3%", %path %numRecords %cachePath);
+    return true;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+bool TextPointsLoader::convertToBinary(const String& path, const String& binaryPath, size_t* numRecords)
+{
+    FILE* fin = fopen(path.c_str(), "r");
+    if(fin == NULL) return false;
+
+    FILE* fout = fopen(binaryPath.c_str(), "wb");
+    if(fout == NULL)
+    {
+        ofwarn("TextPointsLoader: could not create %1%", %binaryPath);
+        fclose(fin);
+        return false;
+    }
+
+    // Records are written as 7 doubles (X,Y,Z,R,G,B,A), in blocks.
+    const int numFields = 7;
+    const size_t blockRecords = 65536;
+    Vector<double> block(blockRecords * numFields);
+    size_t nb = 0;
+    bool ok = true;
+
+    char line[1024];
+    while(ok && fgets(line, 1024, fin) != NULL)
+    {
+        double* record = &block[nb * numFields];
+        // Missing color components default to 1
+        record[3] = record[4] = record[5] = record[6] = 1.0;
+
+        char* c = line;
+        int index = 0;
+        while(index < numFields)
+        {
+            char* end;
+            double v = strtod(c, &end);
+            if(end == c) break;
+            record[index++] = v;
+            c = end;
+        }
+        // Skip blank or malformed lines.
+        if(index < 3) continue;
+
+        if(++nb == blockRecords)
+        {
+            ok = fwrite(&block[0], sizeof(double) * numFields, nb, fout) == nb;
+            *numRecords += nb;
+            nb = 0;
+        }
+    }
+    if(ok && nb > 0)
+    {
+        ok = fwrite(&block[0], sizeof(double) * numFields, nb, fout) == nb;
+        *numRecords += nb;
+    }
+
+    fclose(fin);
+    if(fclose(fout) != 0) ok = false;
+
+    if(!ok) ofwarn("TextPointsLoader: error writing %1%", %binaryPath);
+    return ok && *numRecords > 0;
+}
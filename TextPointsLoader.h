@@ -11,8 +11,14 @@
 #include <osgDB/ReadFile>
 #include <osgDB/FileUtils>
 
+#include "BinaryPointsLoader.h"
+
 using namespace omega;
 
+// Options used to load the binary copy of text files when the model options
+// are empty. See BinaryPointsLoader for the options format.
+#define TEXT_POINTS_DEFAULT_OPTIONS "10000 0:1000000:1"
+
 class TextPointsLoader : public cyclops::ModelLoader
 {
 public:
@@ -26,5 +32,13 @@ public:
 private:
     bool loadFile(const String& file, const String& options, osg::Group * grp);
     void readXYZ(const String& filename, const String& options, osg::Vec3Array* points, osg::Vec4Array* colors);
+
+    // Returns the path of an up to date binary copy of a text file,
+    // converting the file if needed.
+    bool getBinaryCache(const String& path, String& cachePath);
+    bool convertToBinary(const String& path, const String& binaryPath, size_t* numRecords);
+
+private:
+    Ref<BinaryPointsLoader> myBinaryLoader;
 };
 #endif
@@ -4,6 +4,8 @@
 
 #include "TextPointsLoader.h"
 #include "BinaryPointsLoader.h"
+#include "PointArrayPool.h"
+#include "SphereArrayFilter.h"
 
 using namespace omega;
 using namespace cyclops;
@@ -12,9 +14,547 @@ using namespace cyclops;
 // Python wrapper code.
 #ifdef OMEGA_USE_PYTHON
 #include "omega/PythonInterpreterWrapper.h"
+
+#include <osg/Geode>
+#include <osg/Geometry>
+#include <osg/NodeVisitor>
+#include <osg/PagedLOD>
+#include <osg/ValueVisitor>
+
+#include <limits>
+
+using namespace boost::python;
+
+///////////////////////////////////////////////////////////////////////////////
+// Read-only buffer protocol view over (part of) an osg point or color array.
+// The view holds a reference to the array, so the exported memory stays valid
+// as long as python (or a numpy array created from the view) keeps it alive.
+struct PointArrayView
+{
+    PyObject_HEAD
+    osg::Array* array;
+    void* data;
+    Py_ssize_t shape[2];
+    Py_ssize_t strides[2];
+};
+
+static PyTypeObject PointArrayViewType = { PyVarObject_HEAD_INIT(NULL, 0) };
+static PyBufferProcs PointArrayViewBufferProcs;
+
+///////////////////////////////////////////////////////////////////////////////
+static int PointArrayView_getbuffer(PyObject* self, Py_buffer* view, int flags)
+{
+    PointArrayView* pav = (PointArrayView*)self;
+    if((flags & PyBUF_WRITABLE) == PyBUF_WRITABLE)
+    {
+        PyErr_SetString(PyExc_BufferError, "point array views are read-only");
+        view->obj = NULL;
+        return -1;
+    }
+
+    view->obj = self;
+    Py_INCREF(self);
+    view->buf = pav->data;
+    view->len = pav->shape[0] * pav->strides[0];
+    view->readonly = 1;
+    view->itemsize = sizeof(float);
+    view->format = (flags & PyBUF_FORMAT) == PyBUF_FORMAT ? (char*)"f" : NULL;
+    view->ndim = 2;
+    view->shape = (flags & PyBUF_ND) == PyBUF_ND ? pav->shape : NULL;
+    view->strides = (flags & PyBUF_STRIDES) == PyBUF_STRIDES ? pav->strides : NULL;
+    view->suboffsets = NULL;
+    view->internal = NULL;
+    return 0;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+static void PointArrayView_dealloc(PyObject* self)
+{
+    PointArrayView* pav = (PointArrayView*)self;
+    if(pav->array != NULL) pav->array->unref();
+    Py_TYPE(self)->tp_free(self);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Returns false (with a python error set) if the type could not be readied.
+static bool initPointArrayViewType()
+{
+    PointArrayViewBufferProcs.bf_getbuffer = PointArrayView_getbuffer;
+    PointArrayViewBufferProcs.bf_releasebuffer = NULL;
+
+    PointArrayViewType.tp_name = "pointCloud.PointArrayView";
+    PointArrayViewType.tp_basicsize = sizeof(PointArrayView);
+    PointArrayViewType.tp_dealloc = PointArrayView_dealloc;
+    PointArrayViewType.tp_as_buffer = &PointArrayViewBufferProcs;
+    PointArrayViewType.tp_flags = Py_TPFLAGS_DEFAULT;
+#if PY_MAJOR_VERSION < 3
+    PointArrayViewType.tp_flags |= Py_TPFLAGS_HAVE_NEWBUFFER;
+#endif
+    PointArrayViewType.tp_doc = "Read-only view over point cloud batch data";
+    return PyType_Ready(&PointArrayViewType) == 0;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Creates a view of count elements of a float array starting at first. Each
+// element is exported as a row of floats.
+static object createArrayView(osg::Array* array, size_t first, size_t count)
+{
+    PointArrayView* pav = PyObject_New(PointArrayView, &PointArrayViewType);
+    if(pav == NULL) throw_error_already_set();
+
+    size_t elementSize = array->getDataSize() * sizeof(float);
+    array->ref();
+    pav->array = array;
+    pav->data = count > 0 ? (char*)array->getDataPointer() + first * elementSize : NULL;
+    pav->shape[0] = count;
+    pav->shape[1] = array->getDataSize();
+    pav->strides[0] = elementSize;
+    pav->strides[1] = sizeof(float);
+    return object(handle<>((PyObject*)pav));
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Vertex or color array drawing the memory of a python buffer in place. The
+// array keeps the buffer (and the python object exporting it) alive until it
+// is deleted.
+class PythonBufferArray: public osg::Array
+{
+public:
+    //! Takes ownership of view, a C contiguous buffer of float rows.
+    PythonBufferArray(Py_buffer* view, int components):
+        osg::Array(osg::Array::ArrayType, components, GL_FLOAT),
+        myView(*view)
+    {
+        myNumElements = (unsigned int)(myView.len / (components * sizeof(float)));
+    }
+
+    // The buffer can only be used in place: clones are regular arrays.
+    virtual osg::Object* cloneType() const { return createArray(0); }
+    virtual osg::Object* clone(const osg::CopyOp&) const
+    {
+        osg::Array* a = createArray(myNumElements);
+        if(myNumElements > 0) memcpy((void*)a->getDataPointer(), myView.buf, getTotalDataSize());
+        return a;
+    }
+    virtual bool isSameKindAs(const osg::Object* obj) const { return dynamic_cast<const PythonBufferArray*>(obj) != NULL; }
+    virtual const char* className() const { return "PythonBufferArray"; }
+
+    virtual void accept(osg::ArrayVisitor& av) { av.apply(*this); }
+    virtual void accept(osg::ConstArrayVisitor& av) const { av.apply(*this); }
+    virtual void accept(unsigned int index, osg::ValueVisitor& vv)
+    {
+        if(getDataSize() == 3) vv.apply(*(osg::Vec3f*)element(index));
+        else vv.apply(*(osg::Vec4f*)element(index));
+    }
+    virtual void accept(unsigned int index, osg::ConstValueVisitor& vv) const
+    {
+        if(getDataSize() == 3) vv.apply(*(const osg::Vec3f*)element(index));
+        else vv.apply(*(const osg::Vec4f*)element(index));
+    }
+    virtual int compare(unsigned int lhs, unsigned int rhs) const
+    {
+        const float* l = (const float*)element(lhs);
+        const float* r = (const float*)element(rhs);
+        for(int i = 0; i < getDataSize(); i++)
+        {
+            if(l[i] < r[i]) return -1;
+            if(r[i] < l[i]) return 1;
+        }
+        return 0;
+    }
+
+    virtual const GLvoid* getDataPointer() const { return myNumElements > 0 ? myView.buf : NULL; }
+    virtual const GLvoid* getDataPointer(unsigned int index) const { return element(index); }
+    virtual unsigned int getTotalDataSize() const { return myNumElements * getDataSize() * sizeof(float); }
+    virtual unsigned int getNumElements() const { return myNumElements; }
+    // The python buffer has a fixed size.
+    virtual void reserveArray(unsigned int) {}
+    virtual void resizeArray(unsigned int) {}
+
+protected:
+    virtual ~PythonBufferArray()
+    {
+        // Arrays can be released by any thread (i.e. the draw thread), and
+        // after the interpreter is gone.
+        if(Py_IsInitialized())
+        {
+            PyGILState_STATE gs = PyGILState_Ensure();
+            PyBuffer_Release(&myView);
+            PyGILState_Release(gs);
+        }
+    }
+
+private:
+    const void* element(unsigned int index) const
+    {
+        return (const char*)myView.buf + index * getDataSize() * sizeof(float);
+    }
+
+    osg::Array* createArray(unsigned int n) const
+    {
+        if(getDataSize() == 3) return new osg::Vec3Array(n);
+        return new osg::Vec4Array(n);
+    }
+
+    Py_buffer myView;
+    unsigned int myNumElements;
+};
+
+///////////////////////////////////////////////////////////////////////////////
+// Reads a float or double buffer with rows of minComps to num_components
+// values. Contiguous float32 buffers are drawn in place (see
+// PythonBufferArray). Anything else is converted into an A, and missing
+// components are left to their default value.
+template<typename A>
+static osg::Array* readPointBuffer(object src, int minComps,
+    const typename A::ElementDataType& defaultValue, const char* what)
+{
+    typedef typename A::ElementDataType E;
+    const int maxComps = E::num_components;
+
+    Py_buffer view;
+    if(PyObject_GetBuffer(src.ptr(), &view, PyBUF_RECORDS_RO) != 0)
+    {
+        throw_error_already_set();
+    }
+
+    // Skip native / little endian byte order markers.
+    const char* fmt = view.format != NULL ? view.format : "B";
+    if(*fmt == '@' || *fmt == '=' || *fmt == '<') fmt++;
+    bool isFloat = (strcmp(fmt, "f") == 0);
+    bool isDouble = (strcmp(fmt, "d") == 0);
+
+    size_t n = 0;
+    int comps = 0;
+    Py_ssize_t rowStride = 0;
+    Py_ssize_t compStride = view.itemsize;
+    if(view.ndim == 2)
+    {
+        n = view.shape[0];
+        comps = (int)view.shape[1];
+        rowStride = view.strides[0];
+        compStride = view.strides[1];
+    }
+    else if(view.ndim == 1 && view.shape[0] % maxComps == 0)
+    {
+        comps = maxComps;
+        n = view.shape[0] / comps;
+        rowStride = view.strides[0] * comps;
+        compStride = view.strides[0];
+    }
+
+    if((!isFloat && !isDouble) || comps < minComps || comps > maxComps)
+    {
+        PyBuffer_Release(&view);
+        PyErr_Format(PyExc_ValueError,
+            "%s must be a float32 or float64 array of shape (N, %d)", what, maxComps);
+        throw_error_already_set();
+    }
+
+    if(isFloat && n > 0 && PyBuffer_IsContiguous(&view, 'C'))
+    {
+        return new PythonBufferArray(&view, comps);
+    }
+
+    A* dst = new A();
+    dst->resize(n, defaultValue);
+    const char* base = (const char*)view.buf;
+    for(size_t i = 0; i < n; i++)
+    {
+        E& e = (*dst)[i];
+        for(int c = 0; c < comps; c++)
+        {
+            const char* v = base + i * rowStride + c * compStride;
+            e[c] = isFloat ? *(const float*)v : (float)*(const double*)v;
+        }
+    }
+    PyBuffer_Release(&view);
+    return dst;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Creates a point cloud model from python buffer objects (i.e. numpy arrays).
+// points is a Nx3 float array, colors an optional Nx3 or Nx4 float array
+// with colors in the [0-1] range. Contiguous float32 arrays are drawn in
+// place, without copies: they are kept alive by the model, and should not
+// be modified afterwards (changes are not uploaded to the GPU). Other
+// layouts and float64 arrays are converted. The cloud is split into batches
+// of pointsPerBatch points sharing the same vertex arrays, so each batch can
+// be culled independently. The model can then be used like any loaded
+// model, i.e. through StaticObject.create(name)
+bool createPointCloud(const String& name, object points, object colors = object(), int pointsPerBatch = 10000)
+{
+    SceneManager* sm = SceneManager::instance();
+    if(sm == NULL)
+    {
+        owarn("createPointCloud: scene manager not initialized");
+        return false;
+    }
+    if(pointsPerBatch <= 0) pointsPerBatch = 10000;
+
+    Ref<osg::Array> verticesP = readPointBuffer<osg::Vec3Array>(points, 3, osg::Vec3f(), "points");
+    Ref<osg::Array> verticesC;
+    size_t numPoints = verticesP->getNumElements();
+    if(colors.ptr() != Py_None)
+    {
+        verticesC = readPointBuffer<osg::Vec4Array>(colors, 3, osg::Vec4f(1, 1, 1, 1), "colors");
+        if(verticesC->getNumElements() != numPoints)
+        {
+            PyErr_SetString(PyExc_ValueError, "points and colors must have the same length");
+            throw_error_already_set();
+        }
+    }
+    else
+    {
+        osg::Vec4Array* white = new osg::Vec4Array();
+        white->resize(numPoints, osg::Vec4f(1, 1, 1, 1));
+        verticesC = white;
+    }
+
+    // Colors with no alpha are drawn opaque.
+    float maxf = numeric_limits<float>::max();
+    float minf = -numeric_limits<float>::max();
+    Vector4f rgbamin = Vector4f(maxf, maxf, maxf, 1);
+    Vector4f rgbamax = Vector4f(minf, minf, minf, 1);
+    int colorComps = verticesC->getDataSize();
+    const float* color = (const float*)verticesC->getDataPointer();
+    for(size_t i = 0; i < numPoints; i++, color += colorComps)
+    {
+        for(int j = 0; j < colorComps; j++)
+        {
+            if(color[j] < rgbamin[j]) rgbamin[j] = color[j];
+            if(color[j] > rgbamax[j]) rgbamax[j] = color[j];
+        }
+    }
+
+    // All batches draw a range of the same vertex and color arrays.
+    bool inPlace = dynamic_cast<PythonBufferArray*>(verticesP.get()) != NULL;
+    const osg::Vec3f* vertices = (const osg::Vec3f*)verticesP->getDataPointer();
+    Ref<osg::Group> group = new osg::Group();
+    for(size_t batchStart = 0; batchStart < numPoints; batchStart += pointsPerBatch)
+    {
+        size_t prims = pointsPerBatch;
+        if(batchStart + prims > numPoints) prims = numPoints - batchStart;
+
+        osg::Geode* geode = new osg::Geode();
+        geode->setCullingActive(true);
+
+        osg::Geometry* nodeGeom = new osg::Geometry();
+        nodeGeom->addPrimitiveSet(new osg::DrawArrays(osg::PrimitiveSet::POINTS, batchStart, prims));
+        osg::VertexBufferObject* vboP = nodeGeom->getOrCreateVertexBufferObject();
+        vboP->setUsage(GL_STREAM_DRAW);
+
+        nodeGeom->setUseDisplayList(false);
+        nodeGeom->setUseVertexBufferObjects(true);
+        nodeGeom->setVertexArray(verticesP.get());
+        nodeGeom->setColorArray(verticesC.get());
+        nodeGeom->setColorBinding(osg::Geometry::BIND_PER_VERTEX);
+
+        if(inPlace)
+        {
+            osg::BoundingBox box;
+            for(size_t i = batchStart; i < batchStart + prims; i++) box.expandBy(vertices[i]);
+            nodeGeom->setComputeBoundingBoxCallback(new BatchBoundingBox(box));
+        }
+
+        geode->addDrawable(nodeGeom);
+        geode->dirtyBound();
+        group->addChild(geode);
+    }
+
+    ofmsg("[createPointCloud] %1%: <%2%> points in <%3%> batches%4%",
+        %name %numPoints %group->getNumChildren() %(inPlace ? " (drawn in place)" : ""));
+
+    Ref<ModelInfo> info = new ModelInfo();
+    info->name = name;
+    info->loaderOutput = BinaryPointsLoader::formatLoaderOutput(rgbamin, rgbamax);
+
+    Ref<ModelAsset> asset = new ModelAsset();
+    asset->name = name;
+    asset->info = info;
+    asset->nodes.push_back(group);
+    asset->numNodes = 1;
+    sm->addModel(asset);
+    return true;
+}
+BOOST_PYTHON_FUNCTION_OVERLOADS(createPointCloudOverloads, createPointCloud, 2, 4)
+
+///////////////////////////////////////////////////////////////////////////////
+// Collects (points, colors, batch, lod) views for every point geometry
+// currently attached to a scene graph. For paged models only resident
+// batches are part of the graph, so only those are returned. PagedLODs keep
+// coarser levels loaded next to finer ones: only the finest loaded level of
+// each batch is collected, so the same points are never returned twice.
+// Points hidden by the sphere filter are only collected (as a second view of
+// the same batch) when the filter is disabled.
+class PointBatchCollector: public osg::NodeVisitor
+{
+public:
+    PointBatchCollector(): osg::NodeVisitor(osg::NodeVisitor::TRAVERSE_ALL_CHILDREN),
+        myBatch(0), myLod(-1) {}
+
+    virtual void apply(osg::PagedLOD& plod)
+    {
+        // Loaded children are always the first ones, and child i is the LOD
+        // level i. The finest level is the one used closest to the eye.
+        int finest = -1;
+        for(unsigned int i = 0; i < plod.getNumChildren(); i++)
+        {
+            if(finest < 0 || plod.getMinRange(i) < plod.getMinRange(finest)) finest = i;
+        }
+        if(finest >= 0)
+        {
+            myLod = finest;
+            plod.getChild(finest)->accept(*this);
+            myLod = -1;
+        }
+        myBatch++;
+    }
+
+    virtual void apply(osg::Group& group)
+    {
+        // Visible and hidden points of a sphere filtered batch are in two
+        // geodes under the same group.
+        if(myLod < 0 && group.getUpdateCallback() == SphereArrayFilter::getSwitchCallback())
+        {
+            myLod = 0;
+            traverse(group);
+            myLod = -1;
+            myBatch++;
+        }
+        else
+        {
+            traverse(group);
+        }
+    }
+
+    virtual void apply(osg::Geode& geode)
+    {
+        for(unsigned int i = 0; i < geode.getNumDrawables(); i++)
+        {
+            osg::Geometry* geom = geode.getDrawable(i)->asGeometry();
+            if(geom == NULL) continue;
+
+            osg::Array* points = geom->getVertexArray();
+            osg::Array* colors = geom->getColorArray();
+            if(points == NULL || points->getDataType() != GL_FLOAT) continue;
+            if(colors != NULL && colors->getDataType() != GL_FLOAT) colors = NULL;
+
+            // Batches sharing arrays only draw a range of them.
+            size_t first = 0;
+            size_t count = points->getNumElements();
+            if(geom->getNumPrimitiveSets() == 1)
+            {
+                osg::DrawArrays* da = dynamic_cast<osg::DrawArrays*>(geom->getPrimitiveSet(0));
+                if(da != NULL)
+                {
+                    first = da->getFirst();
+                    count = da->getCount();
+                }
+            }
+
+            object c;
+            if(colors != NULL && colors->getNumElements() >= first + count)
+            {
+                c = createArrayView(colors, first, count);
+            }
+            // Geometries outside of PagedLODs are batches on their own.
+            int lod = myLod;
+            if(lod < 0) lod = 0;
+            batches.append(boost::python::make_tuple(
+                createArrayView(points, first, count), c, myBatch, lod));
+            if(myLod < 0) myBatch++;
+        }
+        traverse(geode);
+    }
+
+    boost::python::list batches;
+
+private:
+    int myBatch;
+    int myLod;
+};
+
+///////////////////////////////////////////////////////////////////////////////
+// Returns a list of (points, colors, batch, lod) tuples, one per loaded batch
+// of the named model. points and colors are read-only buffer objects that can
+// be wrapped without copies using numpy.asarray(). colors is None for batches
+// with no colors. batch is the batch index and lod the index of the LOD level
+// the points come from (0 for models that are not paged).
+boost::python::list getPointBatches(const String& modelName)
+{
+    PointBatchCollector pbc;
+    SceneManager* sm = SceneManager::instance();
+    ModelAsset* asset = sm != NULL ? sm->getModel(modelName) : NULL;
+    if(asset == NULL)
+    {
+        ofwarn("getPointBatches: could not find model %1%", %modelName);
+        return pbc.batches;
+    }
+
+    foreach(Ref<osg::Node> n, asset->nodes)
+    {
+        n->accept(pbc);
+    }
+    return pbc.batches;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Returns the statistics of the pool recycling batch arrays and buffers as
+// a dictionary. When paging reaches a steady state, the allocation counts
+// should stop growing.
+dict getArrayPoolStats()
+{
+    PointArrayPool::Stats s = PointArrayPool::instance()->getStats();
+    dict d;
+    d["arrayAllocations"] = s.arrayAllocations;
+    d["arrayReuses"] = s.arrayReuses;
+    d["arraysInUse"] = s.arraysInUse;
+    d["arraysFree"] = s.arraysFree;
+    d["arrayBytes"] = s.arrayBytes;
+    d["arrayUsedBytes"] = s.arrayUsedBytes;
+    d["bufferAllocations"] = s.bufferAllocations;
+    d["bufferReuses"] = s.bufferReuses;
+    d["buffersFree"] = s.buffersFree;
+    d["bufferBytes"] = s.bufferBytes;
+    d["bufferUsedBytes"] = s.bufferUsedBytes;
+    return d;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Returns the number of points hidden by the sphere filter (the thin loader
+// option) as a dictionary.
+dict getSphereFilterStats()
+{
+    SphereArrayFilter::Stats s = SphereArrayFilter::getStats();
+    dict d;
+    d["batches"] = s.batches;
+    d["inputPoints"] = s.inputPoints;
+    d["hiddenPoints"] = s.hiddenPoints;
+    return d;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Enables or disables the sphere filter. Hidden points are only hidden by
+// opaque spheres: disable the filter when drawing with globalAlpha below 1.
+void setSphereFilterEnabled(bool enabled)
+{
+    SphereArrayFilter::setEnabled(enabled);
+}
+
+///////////////////////////////////////////////////////////////////////////////
 BOOST_PYTHON_MODULE(pointCloud)
 {
 	PYAPI_REF_CLASS_WITH_CTOR(TextPointsLoader, ModelLoader);
 	PYAPI_REF_CLASS_WITH_CTOR(BinaryPointsLoader, ModelLoader);
+
+    if(!initPointArrayViewType()) throw_error_already_set();
+    scope().attr("PointArrayView") = handle<>(borrowed((PyObject*)&PointArrayViewType));
+
+    def("createPointCloud", createPointCloud, createPointCloudOverloads());
+    def("getPointBatches", getPointBatches);
+    def("getArrayPoolStats", getArrayPoolStats);
+    def("getSphereFilterStats", getSphereFilterStats);
+    def("setSphereFilterEnabled", setSphereFilterEnabled);
 }
 #endif
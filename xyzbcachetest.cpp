@@ -0,0 +1,509 @@
+///////////////////////////////////////////////////////////////////////////////
+// xyzbcachetest: multi-process test for the shared batch cache.
+// Forks several processes that page the batches of one binary points file
+// through BinaryPointsReader with the shared cache enabled, like render
+// processes on the same host would. Every batch returned by the reader is
+// checked against a local decode of the file. Each process keeps its last
+// batches alive (like resident batches of a paged model) and, before
+// dropping them, checks that they were not evicted while in use.
+// The test runs three times, in a separate cache each time:
+//  - with a budget large enough for all batches: each batch must be
+//    published exactly once, all other reads must be hits.
+//  - with a 1MB budget: batches must be evicted and published again, and
+//    the cache must end within budget.
+//  - with one process killed while holding all the batches: its references
+//    must be released.
+// Batches must always be drawn from the shared segments (publishers
+// included), and no batch must be left referenced or half published when
+// all processes are done. Returns 0 if all checks pass.
+//
+// usage: xyzbcachetest [-f] [-p processes] [-b batches] [-r rounds] [-n records] [file.xyzb]
+// Without a file, a test file of the given number of records is generated
+// and removed at the end. Use -f for files using single precision records.
+///////////////////////////////////////////////////////////////////////////////
+#include <omega.h>
+
+#include <osg/Array>
+#include <osg/Geode>
+#include <osg/Geometry>
+#include <osgDB/Registry>
+#include <osgDB/ReadFile>
+
+#include <deque>
+#include <errno.h>
+#include <signal.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include "BinaryPointsReader.h"
+#include "SharedBatchCache.h"
+
+using namespace omega;
+
+///////////////////////////////////////////////////////////////////////////////
+// Results of one process, in memory shared with the parent.
+struct ProcessResult
+{
+    int hits;
+    int publishes;
+    int skips;
+    int copies;
+    int mismatches;
+    int evictedInUse;
+    int errors;
+};
+
+///////////////////////////////////////////////////////////////////////////////
+struct TestConfig
+{
+    String path;
+    bool singlePrecision;
+    int processes;
+    int batches;
+    int rounds;
+    // Number of batches each process keeps alive
+    int held;
+    size_t records;
+};
+
+///////////////////////////////////////////////////////////////////////////////
+// A batch kept alive by a test process.
+struct HeldBatch
+{
+    int batch;
+    bool mapped;
+    osg::ref_ptr<osg::Node> node;
+};
+
+///////////////////////////////////////////////////////////////////////////////
+void usage()
+{
+    fprintf(stderr, "usage: xyzbcachetest [-f] [-p processes] [-b batches] [-r rounds] [-n records] [file.xyzb]\n");
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Writes a test file with deterministic records.
+bool generateFile(const TestConfig& cfg)
+{
+    FILE* f = fopen(cfg.path.c_str(), "wb");
+    if(f == NULL) return false;
+    srand(1);
+    for(size_t i = 0; i < cfg.records; i++)
+    {
+        double v[7];
+        v[0] = (double)(i % 100) + rand() / (double)RAND_MAX;
+        v[1] = (double)(i / 100 % 100) + rand() / (double)RAND_MAX;
+        v[2] = (double)(i / 10000) + rand() / (double)RAND_MAX;
+        for(int j = 3; j < 7; j++) v[j] = rand() / (double)RAND_MAX;
+        bool written;
+        if(cfg.singlePrecision)
+        {
+            float fv[7];
+            for(int j = 0; j < 7; j++) fv[j] = (float)v[j];
+            written = (fwrite(fv, sizeof(fv), 1, f) == 1);
+        }
+        else
+        {
+            written = (fwrite(v, sizeof(v), 1, f) == 1);
+        }
+        if(!written)
+        {
+            fclose(f);
+            return false;
+        }
+    }
+    return fclose(f) == 0;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Returns the range of a batch, as a percentage of the file records.
+void getBatchRange(const TestConfig& cfg, int batch, int* startP, int* lengthP)
+{
+    *startP = BINARY_POINTS_MAX_BATCHES * batch / cfg.batches;
+    *lengthP = BINARY_POINTS_MAX_BATCHES * (batch + 1) / cfg.batches - *startP;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Returns the name the paged loader would use for a batch.
+String getBatchFilename(const TestConfig& cfg, int batch)
+{
+    int startP, lengthP;
+    getBatchRange(cfg, batch, &startP, &lengthP);
+    String base = cfg.path.substr(0, cfg.path.rfind('.'));
+    return ostr("%1%.%2%-%3%-1.xyzb", %base %startP %lengthP);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Reads a batch straight from the file, without going through the reader.
+bool decodeBatch(const TestConfig& cfg, int batch,
+    osg::ref_ptr<osg::Vec3Array>& points, osg::ref_ptr<osg::Vec4Array>& colors)
+{
+    int startP, lengthP;
+    getBatchRange(cfg, batch, &startP, &lengthP);
+    size_t first = cfg.records * startP / BINARY_POINTS_MAX_BATCHES;
+    size_t count = cfg.records * lengthP / BINARY_POINTS_MAX_BATCHES;
+    if(count == 0 || first + count > cfg.records) count = cfg.records - first;
+    size_t fieldSize = cfg.singlePrecision ? sizeof(float) : sizeof(double);
+    size_t recordSize = fieldSize * 7;
+
+    points = new osg::Vec3Array(count);
+    colors = new osg::Vec4Array(count);
+
+    FILE* f = fopen(cfg.path.c_str(), "rb");
+    if(f == NULL) return false;
+    fseek(f, first * recordSize, SEEK_SET);
+    Vector<char> record(recordSize);
+    for(size_t i = 0; i < count; i++)
+    {
+        if(fread(&record[0], recordSize, 1, f) != 1)
+        {
+            fclose(f);
+            return false;
+        }
+        float v[7];
+        for(int j = 0; j < 7; j++)
+        {
+            if(cfg.singlePrecision) v[j] = ((float*)&record[0])[j];
+            else v[j] = (float)((double*)&record[0])[j];
+        }
+        (*points)[i].set(v[0], v[1], v[2]);
+        (*colors)[i].set(v[3], v[4], v[5], v[6]);
+    }
+    fclose(f);
+    return true;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Returns the vertex and color arrays of a batch returned by the reader.
+bool getBatchArrays(osg::Node* node, osg::Array** points, osg::Array** colors)
+{
+    osg::Geode* geode = node != NULL ? node->asGeode() : NULL;
+    if(geode == NULL || geode->getNumDrawables() == 0) return false;
+    osg::Geometry* geom = geode->getDrawable(0)->asGeometry();
+    if(geom == NULL || geom->getVertexArray() == NULL || geom->getColorArray() == NULL) return false;
+    *points = geom->getVertexArray();
+    *colors = geom->getColorArray();
+    return true;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Returns true if a batch contains the same points as the file.
+bool checkBatch(const TestConfig& cfg, int batch, osg::Node* node)
+{
+    osg::Array* points;
+    osg::Array* colors;
+    osg::ref_ptr<osg::Vec3Array> refPoints;
+    osg::ref_ptr<osg::Vec4Array> refColors;
+    if(!getBatchArrays(node, &points, &colors) || !decodeBatch(cfg, batch, refPoints, refColors)) return false;
+    if(points->getNumElements() != refPoints->size() || colors->getNumElements() != refColors->size()) return false;
+    return refPoints->empty() || (
+        memcmp(points->getDataPointer(), &(*refPoints)[0], refPoints->size() * sizeof(osg::Vec3f)) == 0 &&
+        memcmp(colors->getDataPointer(), &(*refColors)[0], refColors->size() * sizeof(osg::Vec4f)) == 0);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Reads a batch through the reader and classifies the read. Batches mapped
+// from the cache that read nothing from the file are hits, mapped batches
+// read from the file were published by this process, other batches were
+// decoded without going through the cache.
+osg::ref_ptr<osg::Node> readBatch(const TestConfig& cfg, int batch, const osgDB::Options* options,
+    SharedBatchCache::Result* r, bool* mapped)
+{
+    osg::ref_ptr<osg::Node> node = osgDB::readNodeFile(getBatchFilename(cfg, batch), options);
+    osg::Array* points;
+    osg::Array* colors;
+    if(!getBatchArrays(node.get(), &points, &colors)) return NULL;
+
+    double bytesRead = 0;
+    node->getUserValue("bytesRead", bytesRead);
+    *mapped = (strcmp(points->className(), "SharedBatchArray") == 0 &&
+        strcmp(colors->className(), "SharedBatchArray") == 0);
+    if(!*mapped) *r = SharedBatchCache::Skip;
+    else if(bytesRead == 0) *r = SharedBatchCache::Hit;
+    else *r = SharedBatchCache::Publish;
+    return node;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Body of the test processes. If crash is set, the process kills itself
+// while still holding its batches.
+void runProcess(const TestConfig& cfg, const String& cacheName, size_t budgetMB, int id,
+    ProcessResult* result, bool crash)
+{
+    // Attach to the test cache before the reader does: the reader uses the
+    // cache attached by the process, whatever its name.
+    SharedBatchCache* cache = SharedBatchCache::instance(budgetMB, cacheName);
+    if(cache == NULL)
+    {
+        result->errors++;
+        return;
+    }
+
+    osg::ref_ptr<osgDB::Options> options = new osgDB::Options(
+        ostr("xyzrgba -m %1%%2%", %budgetMB %(cfg.singlePrecision ? " -F" : "")));
+    std::deque<HeldBatch> held;
+
+    for(int round = 0; round < cfg.rounds; round++)
+    {
+        for(int i = 0; i < cfg.batches; i++)
+        {
+            // Half the processes walk batches in the same order, so they
+            // compete for the same batches. The others start half way.
+            HeldBatch hb;
+            hb.batch = (id % 2 == 0) ? i : (i + cfg.batches / 2) % cfg.batches;
+
+            SharedBatchCache::Result r;
+            hb.node = readBatch(cfg, hb.batch, options.get(), &r, &hb.mapped);
+            if(!hb.node.valid())
+            {
+                result->errors++;
+                continue;
+            }
+            if(r == SharedBatchCache::Hit) result->hits++;
+            else if(r == SharedBatchCache::Publish) result->publishes++;
+            else result->skips++;
+            if(!checkBatch(cfg, hb.batch, hb.node.get())) result->mismatches++;
+
+            held.push_back(hb);
+            if(crash || (int)held.size() <= cfg.held) continue;
+
+            // A batch still in use must still be cached, and its mapping
+            // must be intact.
+            HeldBatch& oldest = held.front();
+            if(oldest.mapped)
+            {
+                bool mapped;
+                osg::ref_ptr<osg::Node> copy = readBatch(cfg, oldest.batch, options.get(), &r, &mapped);
+                if(!copy.valid()) result->errors++;
+                else if(r != SharedBatchCache::Hit) result->evictedInUse++;
+                result->copies++;
+            }
+            if(!checkBatch(cfg, oldest.batch, oldest.node.get())) result->mismatches++;
+            held.pop_front();
+        }
+    }
+
+    if(crash)
+    {
+        fflush(stdout);
+        kill(getpid(), SIGKILL);
+    }
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Reads the final state of a cache from a separate process, then empties it.
+void checkCache(const String& cacheName, SharedBatchCache::Stats* stats, int* error)
+{
+    SharedBatchCache* cache = SharedBatchCache::instance(1, cacheName);
+    if(cache == NULL)
+    {
+        *error = 1;
+        return;
+    }
+    *stats = cache->getStats();
+    cache->clear();
+}
+
+///////////////////////////////////////////////////////////////////////////////
+bool check(bool condition, const char* what)
+{
+    printf("  %s: %s\n", condition ? "PASS" : "FAIL", what);
+    return condition;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Runs one test phase. Returns true if all checks passed. In crash phases a
+// single process reads all batches and dies holding them.
+bool runPhase(const TestConfig& cfg, size_t budgetMB, bool expectEviction, bool crash)
+{
+    String cacheName = ostr("/pointCloud.test.%1%.%2%%3%", %getpid() %budgetMB %(crash ? ".crash" : ""));
+    shm_unlink(cacheName.c_str());
+    int processes = crash ? 1 : cfg.processes;
+
+    // Results are written by the child processes in shared memory.
+    size_t resultsSize = sizeof(SharedBatchCache::Stats) + sizeof(int) +
+        sizeof(ProcessResult) * processes;
+    void* mem = mmap(NULL, resultsSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if(mem == MAP_FAILED)
+    {
+        fprintf(stderr, "xyzbcachetest: could not map results: %s\n", strerror(errno));
+        return false;
+    }
+    memset(mem, 0, resultsSize);
+    SharedBatchCache::Stats* stats = (SharedBatchCache::Stats*)mem;
+    int* checkError = (int*)(stats + 1);
+    ProcessResult* results = (ProcessResult*)(checkError + 1);
+
+    printf("%d processes, %d batches, %d rounds, budget %dMB%s\n",
+        processes, cfg.batches, cfg.rounds, (int)budgetMB, crash ? ", killed holding all batches" : "");
+    fflush(stdout);
+
+    // Children attach to the cache themselves, so that they race to create it.
+    for(int i = 0; i < processes; i++)
+    {
+        pid_t pid = fork();
+        if(pid == 0)
+        {
+            runProcess(cfg, cacheName, budgetMB, i, &results[i], crash);
+            fflush(stdout);
+            _exit(0);
+        }
+        if(pid < 0) results[i].errors++;
+    }
+    int status;
+    bool crashed = false;
+    while(wait(&status) > 0)
+    {
+        bool killed = WIFSIGNALED(status) && WTERMSIG(status) == SIGKILL;
+        if(crash ? !killed : (!WIFEXITED(status) || WEXITSTATUS(status) != 0)) crashed = true;
+    }
+
+    pid_t pid = fork();
+    if(pid == 0)
+    {
+        checkCache(cacheName, stats, checkError);
+        fflush(stdout);
+        _exit(0);
+    }
+    if(pid < 0) *checkError = 1;
+    else waitpid(pid, &status, 0);
+    shm_unlink(cacheName.c_str());
+
+    ProcessResult total;
+    memset(&total, 0, sizeof(ProcessResult));
+    for(int i = 0; i < processes; i++)
+    {
+        total.hits += results[i].hits;
+        total.publishes += results[i].publishes;
+        total.skips += results[i].skips;
+        total.copies += results[i].copies;
+        total.mismatches += results[i].mismatches;
+        total.evictedInUse += results[i].evictedInUse;
+        total.errors += results[i].errors;
+    }
+    printf("  hits %d, publishes %d, skips %d, cached batches %d, cached bytes %llu\n",
+        total.hits, total.publishes, total.skips, stats->readyBatches,
+        (unsigned long long)stats->totalBytes);
+
+    int reads = processes * cfg.batches * cfg.rounds;
+    bool ok = true;
+    ok &= check(!crashed && total.errors == 0 && *checkError == 0, "processes ran without errors");
+    ok &= check(total.hits + total.publishes + total.skips == reads, "every read was accounted for");
+    ok &= check(total.skips == 0, "all batches drawn from shared memory");
+    ok &= check(total.mismatches == 0, "cached batches match the file");
+    ok &= check(total.evictedInUse == 0, "batches in use were never evicted");
+    ok &= check(stats->refs == 0, "no batch left referenced");
+    ok &= check(stats->publishingBatches == 0, "no batch left half published");
+    ok &= check(stats->processes == 1, "dead processes detached");
+    ok &= check(stats->totalBytes <= stats->budget, "cache within budget");
+    if(expectEviction)
+    {
+        ok &= check(total.publishes > cfg.batches, "evicted batches were published again");
+    }
+    else
+    {
+        ok &= check(total.publishes == cfg.batches, "each batch published once");
+        ok &= check(total.hits == reads - cfg.batches, "all other reads were hits");
+        ok &= check(stats->readyBatches == cfg.batches, "all batches cached");
+    }
+
+    munmap(mem, resultsSize);
+    return ok;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+int main(int argc, char** argv)
+{
+    TestConfig cfg;
+    cfg.singlePrecision = false;
+    cfg.processes = 4;
+    cfg.batches = 50;
+    cfg.rounds = 3;
+    cfg.held = 8;
+    cfg.records = 200000;
+    Vector<String> files;
+    for(int i = 1; i < argc; i++)
+    {
+        String arg = argv[i];
+        if(arg == "-f") cfg.singlePrecision = true;
+        else if(arg == "-p" && i + 1 < argc) cfg.processes = atoi(argv[++i]);
+        else if(arg == "-b" && i + 1 < argc) cfg.batches = atoi(argv[++i]);
+        else if(arg == "-r" && i + 1 < argc) cfg.rounds = atoi(argv[++i]);
+        else if(arg == "-n" && i + 1 < argc) cfg.records = atol(argv[++i]);
+        else if(arg[0] == '-')
+        {
+            usage();
+            return 1;
+        }
+        else files.push_back(arg);
+    }
+    if(files.size() > 1 || cfg.processes < 1 || cfg.processes >= SHARED_BATCH_CACHE_MAX_PROCESSES ||
+        cfg.rounds < 1 || cfg.batches < 1 || cfg.batches > BINARY_POINTS_MAX_BATCHES)
+    {
+        usage();
+        return 1;
+    }
+
+    bool generated = files.empty();
+    if(generated)
+    {
+        char name[] = "/tmp/xyzbcachetestXXXXXX.xyzb";
+        int fd = mkstemps(name, 5);
+        if(fd < 0)
+        {
+            fprintf(stderr, "xyzbcachetest: could not create a test file: %s\n", strerror(errno));
+            return 1;
+        }
+        close(fd);
+        cfg.path = name;
+        if(!generateFile(cfg))
+        {
+            fprintf(stderr, "xyzbcachetest: could not write %s\n", cfg.path.c_str());
+            remove(cfg.path.c_str());
+            return 1;
+        }
+        printf("Generated %s (%d records)\n", cfg.path.c_str(), (int)cfg.records);
+    }
+    else
+    {
+        cfg.path = files[0];
+        FILE* f = fopen(cfg.path.c_str(), "rb");
+        if(f == NULL)
+        {
+            fprintf(stderr, "xyzbcachetest: could not open %s\n", cfg.path.c_str());
+            return 1;
+        }
+        fseek(f, 0, SEEK_END);
+        size_t fileSize = ftell(f);
+        fclose(f);
+        cfg.records = fileSize / ((cfg.singlePrecision ? sizeof(float) : sizeof(double)) * 7);
+    }
+
+    // Data files are looked up by absolute path or relative to the current
+    // directory, like in xyzbsim.
+    DataManager* dm = DataManager::getInstance();
+    dm->addSource(new FilesystemDataSource("./"));
+    dm->addSource(new FilesystemDataSource(""));
+    osgDB::Registry::instance()->addReaderWriter(new BinaryPointsReader());
+
+    // Decoded batches take 7 floats per point, plus a small header each.
+    size_t decodedBytes = cfg.records * (sizeof(osg::Vec3f) + sizeof(osg::Vec4f)) + cfg.batches * 64;
+    size_t fullBudgetMB = decodedBytes / (1024 * 1024) + 1;
+
+    bool ok = runPhase(cfg, fullBudgetMB, false, false);
+    if(decodedBytes > 2 * 1024 * 1024)
+    {
+        ok &= runPhase(cfg, 1, true, false);
+    }
+    else
+    {
+        printf("Skipping eviction test: decoded data (%d bytes) fits in 2MB\n", (int)decodedBytes);
+    }
+    ok &= runPhase(cfg, fullBudgetMB, false, true);
+
+    if(generated) remove(cfg.path.c_str());
+
+    printf("%s\n", ok ? "All checks passed" : "Some checks failed");
+    return ok ? 0 : 1;
+}
@@ -0,0 +1,420 @@
+///////////////////////////////////////////////////////////////////////////////
+// xyzbsim: headless paging simulator for binary point clouds.
+// Builds the same PagedLOD graph as BinaryPointsLoader, then replays a camera
+// path against it, applying the PagedLOD range, load ordering and expiry
+// rules. Batch loads go through BinaryPointsReader on background threads,
+// like the database pager would do, but no graphics context is needed.
+// Like the database pager, expired children are only unloaded when the
+// number of PagedLODs goes over the pager target (300 by default in OSG, set
+// with -maxplod or the OSG_MAX_PAGEDLOD environment variable).
+// For each frame the tool reports requested and resident batches, bytes read
+// from the file as reported by the reader (shared cache hits read nothing)
+// and holes (batches that need a LOD level that is not loaded yet). Load
+// latency percentiles are reported at the end.
+//
+// usage: xyzbsim [-fps N] [-t threads] [-maxplod N] [-fast] file.xyzb "options" camera.txt
+// The camera file contains one eye position (x y z) per line, one line per
+// frame.
+///////////////////////////////////////////////////////////////////////////////
+#include <omega.h>
+#include <cyclops/cyclops.h>
+
+#include <osg/PagedLOD>
+#include <osg/Timer>
+#include <osg/Geode>
+#include <osg/Geometry>
+#include <OpenThreads/Thread>
+#include <OpenThreads/Mutex>
+#include <OpenThreads/ScopedLock>
+
+#include <algorithm>
+#include <list>
+
+#include "BinaryPointsLoader.h"
+
+using namespace omega;
+using namespace cyclops;
+
+///////////////////////////////////////////////////////////////////////////////
+struct LoadRequest
+{
+    int batch;
+    int child;
+    String filename;
+    osg::ref_ptr<osgDB::Options> options;
+    double requestTime;
+    double completeTime;
+    osg::ref_ptr<osg::Node> node;
+};
+
+///////////////////////////////////////////////////////////////////////////////
+// Per PagedLOD simulation state
+struct BatchState
+{
+    osg::PagedLOD* plod;
+    Vector<int> lastFrame;
+    Vector<double> lastTime;
+    bool pending;
+};
+
+///////////////////////////////////////////////////////////////////////////////
+// Queue of load requests, serviced by the loader threads.
+class LoadQueue
+{
+public:
+    LoadQueue(): myDone(false) {}
+
+    void push(const LoadRequest& r)
+    {
+        OpenThreads::ScopedLock<OpenThreads::Mutex> lock(myLock);
+        myRequests.push_back(r);
+    }
+
+    bool pop(LoadRequest& r)
+    {
+        OpenThreads::ScopedLock<OpenThreads::Mutex> lock(myLock);
+        if(myRequests.empty()) return false;
+        r = myRequests.front();
+        myRequests.pop_front();
+        return true;
+    }
+
+    void complete(const LoadRequest& r)
+    {
+        OpenThreads::ScopedLock<OpenThreads::Mutex> lock(myLock);
+        myCompleted.push_back(r);
+    }
+
+    void takeCompleted(std::vector<LoadRequest>& completed)
+    {
+        OpenThreads::ScopedLock<OpenThreads::Mutex> lock(myLock);
+        completed.swap(myCompleted);
+    }
+
+    volatile bool myDone;
+
+private:
+    OpenThreads::Mutex myLock;
+    std::list<LoadRequest> myRequests;
+    std::vector<LoadRequest> myCompleted;
+};
+
+///////////////////////////////////////////////////////////////////////////////
+class LoaderThread: public OpenThreads::Thread
+{
+public:
+    LoaderThread(LoadQueue* queue): myQueue(queue) {}
+
+    virtual void run()
+    {
+        osg::Timer* timer = osg::Timer::instance();
+        LoadRequest r;
+        while(!myQueue->myDone)
+        {
+            if(myQueue->pop(r))
+            {
+                r.node = osgDB::readNodeFile(r.filename, r.options.get());
+                r.completeTime = timer->time_s();
+                myQueue->complete(r);
+            }
+            else
+            {
+                OpenThreads::Thread::microSleep(500);
+            }
+        }
+    }
+
+private:
+    LoadQueue* myQueue;
+};
+
+///////////////////////////////////////////////////////////////////////////////
+// Returns the number of bytes the reader read from the file for a batch.
+static size_t getBytesRead(osg::Node* node)
+{
+    double bytes = 0;
+    if(node != NULL) node->getUserValue("bytesRead", bytes);
+    return (size_t)bytes;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+static double percentile(const std::vector<double>& sorted, double p)
+{
+    if(sorted.empty()) return 0;
+    size_t i = (size_t)(p * (sorted.size() - 1) + 0.5);
+    return sorted[i];
+}
+
+///////////////////////////////////////////////////////////////////////////////
+static void usage()
+{
+    printf(
+        "usage: xyzbsim [options] file.xyzb \"loader options\" camera.txt\n"
+        "  -fps N       frames per second of the camera path (default: 60)\n"
+        "  -t threads   loader threads (default: 1)\n"
+        "  -maxplod N   database pager target number of PagedLODs (default: 300)\n"
+        "  -fast        replay frames as fast as possible instead of in real time\n");
+}
+
+///////////////////////////////////////////////////////////////////////////////
+int main(int argc, char** argv)
+{
+    double fps = 60;
+    int numThreads = 1;
+    bool realTime = true;
+    // Same default as osgDB::DatabasePager
+    int maxPagedLODs = 300;
+    const char* maxPagedLODsEnv = getenv("OSG_MAX_PAGEDLOD");
+    if(maxPagedLODsEnv != NULL) maxPagedLODs = atoi(maxPagedLODsEnv);
+    Vector<String> files;
+    for(int i = 1; i < argc; i++)
+    {
+        String arg = argv[i];
+        if(arg == "-fps" && i + 1 < argc) fps = atof(argv[++i]);
+        else if(arg == "-t" && i + 1 < argc) numThreads = atoi(argv[++i]);
+        else if(arg == "-maxplod" && i + 1 < argc) maxPagedLODs = atoi(argv[++i]);
+        else if(arg == "-fast") realTime = false;
+        else if(arg[0] == '-')
+        {
+            usage();
+            return 1;
+        }
+        else files.push_back(arg);
+    }
+    if(files.size() != 3 || fps <= 0 || numThreads < 1 || maxPagedLODs < 0)
+    {
+        usage();
+        return 1;
+    }
+
+    // Load the camera path
+    Vector<osg::Vec3d> path;
+    FILE* cf = fopen(files[2].c_str(), "r");
+    if(cf == NULL)
+    {
+        fprintf(stderr, "xyzbsim: could not open %s\n", files[2].c_str());
+        return 1;
+    }
+    char line[256];
+    while(fgets(line, 256, cf) != NULL)
+    {
+        double x, y, z;
+        if(line[0] != '#' && sscanf(line, "%lf %lf %lf", &x, &y, &z) == 3)
+        {
+            path.push_back(osg::Vec3d(x, y, z));
+        }
+    }
+    fclose(cf);
+
+    // Build the paged graph exactly like the loader does. Data files are
+    // looked up relative to the current directory or by absolute path.
+    DataManager* dm = DataManager::getInstance();
+    dm->addSource(new FilesystemDataSource("./"));
+    dm->addSource(new FilesystemDataSource(""));
+
+    Ref<BinaryPointsLoader> loader = new BinaryPointsLoader();
+    Ref<ModelAsset> asset = new ModelAsset();
+    asset->info = new ModelInfo();
+    asset->info->path = files[0];
+    asset->info->options = files[1];
+    if(!loader->load(asset) || asset->nodes.empty())
+    {
+        fprintf(stderr, "xyzbsim: could not load %s\n", files[0].c_str());
+        return 1;
+    }
+
+    osg::Group* root = asset->nodes[0]->asGroup();
+    Vector<BatchState> batches;
+    for(unsigned int i = 0; root != NULL && i < root->getNumChildren(); i++)
+    {
+        osg::PagedLOD* plod = dynamic_cast<osg::PagedLOD*>(root->getChild(i));
+        if(plod == NULL) continue;
+        BatchState bs;
+        bs.plod = plod;
+        bs.lastFrame.resize(plod->getNumRanges(), 0);
+        bs.lastTime.resize(plod->getNumRanges(), 0);
+        bs.pending = false;
+        batches.push_back(bs);
+    }
+
+    printf("# %d batches, %d frames at %.0f fps, %d loader threads, PagedLOD target %d\n",
+        (int)batches.size(), (int)path.size(), fps, numThreads, maxPagedLODs);
+    if((int)batches.size() <= maxPagedLODs)
+    {
+        printf("# batches within the PagedLOD target: no children will expire\n");
+    }
+    printf("# frame requested pending resident holes empty loaded bytesRead\n");
+
+    LoadQueue queue;
+    Vector<LoaderThread*> threads;
+    for(int i = 0; i < numThreads; i++)
+    {
+        threads.push_back(new LoaderThread(&queue));
+        threads.back()->start();
+    }
+
+    osg::Timer* timer = osg::Timer::instance();
+    double startTime = timer->time_s();
+
+    std::vector<double> latencies;
+    std::vector<LoadRequest> completed;
+    size_t totalRequests = 0;
+    size_t totalBytes = 0;
+    size_t totalHoles = 0;
+    size_t framesWithHoles = 0;
+    size_t totalUnloads = 0;
+    size_t pending = 0;
+
+    for(int frame = 0; frame < path.size(); frame++)
+    {
+        double frameStart = startTime + frame / fps;
+        if(realTime)
+        {
+            double now = timer->time_s();
+            if(now < frameStart) OpenThreads::Thread::microSleep((frameStart - now) * 1e6);
+        }
+        double t = timer->time_s();
+
+        // Merge loaded batches, like DatabasePager::updateSceneGraph
+        size_t loaded = 0;
+        size_t bytes = 0;
+        queue.takeCompleted(completed);
+        foreach(LoadRequest& r, completed)
+        {
+            BatchState& bs = batches[r.batch];
+            bs.pending = false;
+            pending--;
+            latencies.push_back(r.completeTime - r.requestTime);
+            if(r.node.valid() && bs.plod->getNumChildren() == r.child)
+            {
+                bs.plod->addChild(r.node.get());
+                bs.lastFrame[r.child] = frame;
+                bs.lastTime[r.child] = t;
+                bytes += getBytesRead(r.node.get());
+                loaded++;
+            }
+        }
+        completed.clear();
+
+        // Cull traversal: same range logic as PagedLOD::traverse
+        const osg::Vec3d& eye = path[frame];
+        size_t requested = 0;
+        size_t holes = 0;
+        size_t empty = 0;
+        size_t resident = 0;
+        for(int b = 0; b < batches.size(); b++)
+        {
+            BatchState& bs = batches[b];
+            osg::PagedLOD* plod = bs.plod;
+            float d = (eye - osg::Vec3d(plod->getCenter())).length();
+            int numChildren = plod->getNumChildren();
+            resident += numChildren;
+
+            bool needToLoad = false;
+            int lastTraversed = -1;
+            for(unsigned int i = 0; i < plod->getNumRanges(); i++)
+            {
+                if(plod->getMinRange(i) <= d && d < plod->getMaxRange(i))
+                {
+                    if(i < numChildren)
+                    {
+                        bs.lastFrame[i] = frame;
+                        bs.lastTime[i] = t;
+                        lastTraversed = i;
+                    }
+                    else
+                    {
+                        needToLoad = true;
+                    }
+                }
+            }
+
+            if(needToLoad)
+            {
+                holes++;
+                // Display the highest loaded level in the meantime.
+                if(numChildren > 0)
+                {
+                    bs.lastFrame[numChildren - 1] = frame;
+                    bs.lastTime[numChildren - 1] = t;
+                }
+                else if(lastTraversed < 0)
+                {
+                    empty++;
+                }
+
+                // Children are loaded in order.
+                if(!bs.pending && numChildren < plod->getNumFileNames())
+                {
+                    LoadRequest r;
+                    r.batch = b;
+                    r.child = numChildren;
+                    r.filename = plod->getDatabasePath() + plod->getFileName(numChildren);
+                    r.options = dynamic_cast<osgDB::Options*>(plod->getDatabaseOptions());
+                    r.requestTime = t;
+                    queue.push(r);
+                    bs.pending = true;
+                    pending++;
+                    requested++;
+                }
+            }
+        }
+
+        // Like DatabasePager::removeExpiredSubgraphs, only prune when there
+        // are more PagedLODs than the pager target, and expire at most one
+        // child for each PagedLOD over the target. Each PagedLOD can only
+        // expire its last child, once it has not been used for long enough
+        // (PagedLOD::removeExpiredChildren).
+        int numToPrune = (int)batches.size() - maxPagedLODs;
+        double expiryTime = t - 0.1;
+        int expiryFrame = frame - 1;
+        for(int b = 0; b < batches.size() && numToPrune > 0; b++)
+        {
+            BatchState& bs = batches[b];
+            osg::PagedLOD* plod = bs.plod;
+            int numChildren = plod->getNumChildren();
+            if(numChildren > plod->getNumChildrenThatCannotBeExpired())
+            {
+                int c = numChildren - 1;
+                if(bs.lastTime[c] + plod->getMinimumExpiryTime(c) < expiryTime &&
+                    bs.lastFrame[c] + (int)plod->getMinimumExpiryFrames(c) < expiryFrame)
+                {
+                    plod->removeChildren(c, 1);
+                    totalUnloads++;
+                    numToPrune--;
+                }
+            }
+        }
+
+        totalRequests += requested;
+        totalBytes += bytes;
+        totalHoles += holes;
+        if(holes > 0) framesWithHoles++;
+
+        printf("%d %d %d %d %d %d %d %lu\n",
+            frame, (int)requested, (int)pending, (int)resident,
+            (int)holes, (int)empty, (int)loaded, (unsigned long)bytes);
+    }
+
+    queue.myDone = true;
+    foreach(LoaderThread* lt, threads)
+    {
+        lt->join();
+        delete lt;
+    }
+
+    double elapsed = timer->time_s() - startTime;
+    std::sort(latencies.begin(), latencies.end());
+    printf("# frames %d  time %.2fs  requests %lu  loads %lu  unloads %lu  MB read from file %.2f\n",
+        (int)path.size(), elapsed,
+        (unsigned long)totalRequests, (unsigned long)latencies.size(),
+        (unsigned long)totalUnloads, totalBytes / (1024.0 * 1024.0));
+    printf("# holes %lu  frames with holes %lu\n",
+        (unsigned long)totalHoles, (unsigned long)framesWithHoles);
+    printf("# load latency ms  p50 %.2f  p90 %.2f  p99 %.2f  max %.2f\n",
+        percentile(latencies, 0.5) * 1000,
+        percentile(latencies, 0.9) * 1000,
+        percentile(latencies, 0.99) * 1000,
+        latencies.empty() ? 0.0 : latencies.back() * 1000);
+    return 0;
+}
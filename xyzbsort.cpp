@@ -0,0 +1,589 @@
+///////////////////////////////////////////////////////////////////////////////
+// xyzbsort: reorders the records of a binary points file (.xyzb) along a
+// space filling curve (Hilbert or Morton order), so that the percentage based
+// batches used by BinaryPointsLoader cover compact regions of space.
+// Sorting is done out of core: the input is split in runs that fit in the
+// given memory budget, runs are sorted in parallel and written to temporary
+// files, then merged into the output file. When there are too many runs to
+// merge at once, groups of runs are merged into longer runs first. The output
+// has the same format (and precision) as the input.
+//
+// usage: xyzbsort [-f] [-c hilbert|morton] [-m memoryMB] [-t threads] input output
+///////////////////////////////////////////////////////////////////////////////
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+
+#include <algorithm>
+#include <limits>
+#include <queue>
+#include <string>
+#include <thread>
+#include <mutex>
+#include <chrono>
+#include <vector>
+
+using namespace std;
+
+// Each record contains 7 fields (X,Y,Z,R,G,B,A)
+#define NUM_FIELDS 7
+// Bits per coordinate in space filling curve keys
+#define KEY_BITS 21
+// Maximum number of runs merged at once. Each run being merged keeps a file
+// open and a read buffer.
+#define MAX_MERGE_FAN_IN 256
+// Preferred size of run read buffers during merges, in records. Buffers are
+// smaller when the memory budget is too low.
+#define MERGE_BUFFER_RECORDS 1024
+
+typedef chrono::steady_clock Clock;
+
+///////////////////////////////////////////////////////////////////////////////
+struct SortOptions
+{
+    SortOptions():
+        singlePrecision(false),
+        hilbert(true),
+        memoryMB(1024),
+        threads(0) {}
+
+    bool singlePrecision;
+    bool hilbert;
+    size_t memoryMB;
+    unsigned int threads;
+    string input;
+    string output;
+};
+
+///////////////////////////////////////////////////////////////////////////////
+static double secondsSince(Clock::time_point t)
+{
+    return chrono::duration<double>(Clock::now() - t).count();
+}
+
+///////////////////////////////////////////////////////////////////////////////
+static void reportPhase(const char* phase, size_t records, size_t recordSize, double seconds)
+{
+    if(seconds <= 0) seconds = 1e-6;
+    printf("%-8s %12zu points  %8.2fs  %10.2f Mpoints/s  %8.2f MB/s\n",
+        phase, records, seconds,
+        records / seconds / 1e6,
+        (double)records * recordSize / seconds / (1024 * 1024));
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Interleaves the low KEY_BITS bits of x, y, z (x most significant).
+static uint64_t mortonKey(uint32_t x, uint32_t y, uint32_t z)
+{
+    uint64_t key = 0;
+    for(int b = KEY_BITS - 1; b >= 0; b--)
+    {
+        key = (key << 3) |
+            (((x >> b) & 1) << 2) |
+            (((y >> b) & 1) << 1) |
+            ((z >> b) & 1);
+    }
+    return key;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Hilbert key, using Skilling's axes to transpose conversion ("Programming
+// the Hilbert curve", AIP Conf. Proc. 707, 2004). The transposed coordinates
+// interleaved are the Hilbert index.
+static uint64_t hilbertKey(uint32_t x, uint32_t y, uint32_t z)
+{
+    uint32_t X[3] = { x, y, z };
+    uint32_t M = 1u << (KEY_BITS - 1);
+    uint32_t P, Q, t;
+
+    // Inverse undo
+    for(Q = M; Q > 1; Q >>= 1)
+    {
+        P = Q - 1;
+        for(int i = 0; i < 3; i++)
+        {
+            if(X[i] & Q) X[0] ^= P;
+            else
+            {
+                t = (X[0] ^ X[i]) & P;
+                X[0] ^= t;
+                X[i] ^= t;
+            }
+        }
+    }
+
+    // Gray encode
+    for(int i = 1; i < 3; i++) X[i] ^= X[i - 1];
+    t = 0;
+    for(Q = M; Q > 1; Q >>= 1)
+    {
+        if(X[2] & Q) t ^= Q - 1;
+    }
+    for(int i = 0; i < 3; i++) X[i] ^= t;
+
+    return mortonKey(X[0], X[1], X[2]);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+template<typename T>
+class PointSorter
+{
+public:
+    PointSorter(const SortOptions& opts): myOptions(opts), myNumRuns(0) {}
+
+    bool run();
+
+private:
+    // Run files store each record prefixed by its key.
+    struct RunRecord
+    {
+        uint64_t key;
+        T fields[NUM_FIELDS];
+    };
+
+    struct RunReader
+    {
+        FILE* file;
+        vector<RunRecord> buffer;
+        size_t pos;
+        size_t count;
+
+        bool next()
+        {
+            if(++pos < count) return true;
+            count = fread(&buffer[0], sizeof(RunRecord), buffer.size(), file);
+            pos = 0;
+            return count > 0;
+        }
+        const RunRecord& current() const { return buffer[pos]; }
+    };
+
+    bool computeBounds();
+    bool generateRuns();
+    void runThread();
+    bool mergeRuns();
+    bool mergeGroup(size_t first, size_t count, const string& filename, bool keepKeys, size_t bufferRecords);
+    uint64_t computeKey(const T* record) const;
+    string getRunFilename(size_t run) const;
+
+private:
+    SortOptions myOptions;
+    size_t myNumRecords;
+    double myMin[3];
+    double myScale[3];
+
+    // Run generation state, shared by the sorting threads.
+    mutex myLock;
+    FILE* myInput;
+    size_t myRecordsPerRun;
+    size_t myNextRecord;
+    size_t myNumRuns;
+    // Number of records in each run
+    vector<size_t> myRunSizes;
+    bool myFailed;
+};
+
+///////////////////////////////////////////////////////////////////////////////
+template<typename T>
+uint64_t PointSorter<T>::computeKey(const T* record) const
+{
+    uint32_t c[3];
+    const double maxc = (double)((1u << KEY_BITS) - 1);
+    for(int i = 0; i < 3; i++)
+    {
+        double v = (record[i] - myMin[i]) * myScale[i];
+        if(v < 0) v = 0;
+        if(v > maxc) v = maxc;
+        c[i] = (uint32_t)v;
+    }
+    return myOptions.hilbert ? hilbertKey(c[0], c[1], c[2]) : mortonKey(c[0], c[1], c[2]);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+template<typename T>
+string PointSorter<T>::getRunFilename(size_t run) const
+{
+    char suffix[32];
+    snprintf(suffix, 32, ".run%zu.tmp", run);
+    return myOptions.output + suffix;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+template<typename T>
+bool PointSorter<T>::run()
+{
+    Clock::time_point start = Clock::now();
+    if(!computeBounds()) return false;
+
+    // Run files can be as large as the input: remove them even when run
+    // generation fails half way.
+    bool result = generateRuns() && mergeRuns();
+    for(size_t i = 0; i < myNumRuns; i++) remove(getRunFilename(i).c_str());
+
+    if(result)
+    {
+        reportPhase("total", myNumRecords, sizeof(T) * NUM_FIELDS, secondsSince(start));
+    }
+    return result;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+template<typename T>
+bool PointSorter<T>::computeBounds()
+{
+    Clock::time_point start = Clock::now();
+    size_t recordSize = sizeof(T) * NUM_FIELDS;
+
+    FILE* fin = fopen(myOptions.input.c_str(), "rb");
+    if(fin == NULL)
+    {
+        fprintf(stderr, "xyzbsort: could not open %s\n", myOptions.input.c_str());
+        return false;
+    }
+
+    double bmin[3], bmax[3];
+    for(int i = 0; i < 3; i++)
+    {
+        bmin[i] = numeric_limits<double>::max();
+        bmax[i] = -numeric_limits<double>::max();
+    }
+
+    vector<T> buffer(NUM_FIELDS * 65536);
+    myNumRecords = 0;
+    size_t ne;
+    while((ne = fread(&buffer[0], recordSize, 65536, fin)) > 0)
+    {
+        for(size_t r = 0; r < ne; r++)
+        {
+            const T* record = &buffer[r * NUM_FIELDS];
+            for(int i = 0; i < 3; i++)
+            {
+                if(record[i] < bmin[i]) bmin[i] = record[i];
+                if(record[i] > bmax[i]) bmax[i] = record[i];
+            }
+        }
+        myNumRecords += ne;
+    }
+    fclose(fin);
+
+    if(myNumRecords == 0)
+    {
+        fprintf(stderr, "xyzbsort: %s contains no points\n", myOptions.input.c_str());
+        return false;
+    }
+
+    // Use the same scale on all axes, so the curve cells are cubes.
+    double extent = 0;
+    for(int i = 0; i < 3; i++) extent = max(extent, bmax[i] - bmin[i]);
+    for(int i = 0; i < 3; i++)
+    {
+        myMin[i] = bmin[i];
+        myScale[i] = extent > 0 ? ((1u << KEY_BITS) - 1) / extent : 0;
+    }
+
+    printf("bounds   (%g %g %g) - (%g %g %g)\n",
+        bmin[0], bmin[1], bmin[2], bmax[0], bmax[1], bmax[2]);
+    reportPhase("bounds", myNumRecords, recordSize, secondsSince(start));
+    return true;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+template<typename T>
+bool PointSorter<T>::generateRuns()
+{
+    Clock::time_point start = Clock::now();
+
+    unsigned int numThreads = myOptions.threads;
+    if(numThreads == 0) numThreads = max(1u, thread::hardware_concurrency());
+
+    // Each thread holds a run of records, the keyed copy of the run and the
+    // sort permutation.
+    size_t perRecord = sizeof(T) * NUM_FIELDS + sizeof(RunRecord) + sizeof(pair<uint64_t, uint32_t>);
+    size_t budget = myOptions.memoryMB * 1024 * 1024 / numThreads;
+    myRecordsPerRun = max((size_t)1, budget / perRecord);
+    // Indices in the sort permutation are 32 bit.
+    myRecordsPerRun = min(myRecordsPerRun, (size_t)numeric_limits<uint32_t>::max());
+    if(myRecordsPerRun > myNumRecords) myRecordsPerRun = myNumRecords;
+
+    myInput = fopen(myOptions.input.c_str(), "rb");
+    if(myInput == NULL)
+    {
+        fprintf(stderr, "xyzbsort: could not open %s\n", myOptions.input.c_str());
+        return false;
+    }
+    myNextRecord = 0;
+    myNumRuns = 0;
+    myRunSizes.clear();
+    myFailed = false;
+
+    vector<thread> threads;
+    for(unsigned int i = 0; i < numThreads; i++)
+    {
+        threads.push_back(thread(&PointSorter<T>::runThread, this));
+    }
+    for(size_t i = 0; i < threads.size(); i++) threads[i].join();
+    fclose(myInput);
+
+    printf("runs     %zu runs of up to %zu points, %u threads\n",
+        myNumRuns, myRecordsPerRun, numThreads);
+    reportPhase("sort", myNumRecords, sizeof(T) * NUM_FIELDS, secondsSince(start));
+    return !myFailed;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+template<typename T>
+void PointSorter<T>::runThread()
+{
+    size_t recordSize = sizeof(T) * NUM_FIELDS;
+    vector<T> records;
+    vector<RunRecord> sorted;
+    vector< pair<uint64_t, uint32_t> > keys;
+
+    while(true)
+    {
+        // Reading is serialized, sorting and writing runs are not.
+        size_t run;
+        size_t ne;
+        {
+            lock_guard<mutex> lock(myLock);
+            if(myFailed || myNextRecord >= myNumRecords) return;
+
+            size_t count = min(myRecordsPerRun, myNumRecords - myNextRecord);
+            records.resize(count * NUM_FIELDS);
+            ne = fread(&records[0], recordSize, count, myInput);
+            if(ne != count)
+            {
+                fprintf(stderr, "xyzbsort: short read from %s\n", myOptions.input.c_str());
+                myFailed = true;
+                return;
+            }
+            myNextRecord += count;
+            run = myNumRuns++;
+            myRunSizes.push_back(count);
+        }
+
+        keys.resize(ne);
+        for(size_t i = 0; i < ne; i++)
+        {
+            keys[i].first = computeKey(&records[i * NUM_FIELDS]);
+            keys[i].second = (uint32_t)i;
+        }
+        sort(keys.begin(), keys.end());
+
+        sorted.resize(ne);
+        for(size_t i = 0; i < ne; i++)
+        {
+            sorted[i].key = keys[i].first;
+            memcpy(sorted[i].fields, &records[keys[i].second * NUM_FIELDS], recordSize);
+        }
+
+        string filename = getRunFilename(run);
+        FILE* fout = fopen(filename.c_str(), "wb");
+        bool written = (fout != NULL && fwrite(&sorted[0], sizeof(RunRecord), ne, fout) == ne);
+        // Buffered data is only flushed on close, which can fail too.
+        if(fout != NULL && fclose(fout) != 0) written = false;
+        if(!written)
+        {
+            fprintf(stderr, "xyzbsort: could not write run file %s\n", filename.c_str());
+            lock_guard<mutex> lock(myLock);
+            myFailed = true;
+            return;
+        }
+    }
+}
+
+///////////////////////////////////////////////////////////////////////////////
+template<typename T>
+bool PointSorter<T>::mergeRuns()
+{
+    Clock::time_point start = Clock::now();
+    size_t recordSize = sizeof(T) * NUM_FIELDS;
+
+    // The read buffers of the runs merged at once and the output buffer
+    // must fit in the memory budget: merge fewer runs at once rather than
+    // use tiny buffers, down to 2 runs.
+    size_t budget = myOptions.memoryMB * 1024 * 1024;
+    size_t fanIn = budget / (MERGE_BUFFER_RECORDS * sizeof(RunRecord));
+    fanIn = min((size_t)MAX_MERGE_FAN_IN, max((size_t)3, fanIn) - 1);
+    size_t bufferRecords = max((size_t)1, budget / (fanIn + 1) / sizeof(RunRecord));
+
+    // Merge groups of runs into new runs until the remaining runs can be
+    // merged at once into the output.
+    size_t first = 0;
+    int passes = 1;
+    while(myNumRuns - first > fanIn)
+    {
+        size_t last = myNumRuns;
+        for(size_t r = first; r < last; r += fanIn)
+        {
+            size_t count = min(fanIn, last - r);
+            size_t run = myNumRuns++;
+            myRunSizes.push_back(0);
+            for(size_t i = r; i < r + count; i++) myRunSizes[run] += myRunSizes[i];
+
+            bool merged = (count == 1) ?
+                rename(getRunFilename(r).c_str(), getRunFilename(run).c_str()) == 0 :
+                mergeGroup(r, count, getRunFilename(run), true, bufferRecords);
+            if(!merged) return false;
+            // Free disk space as soon as possible.
+            for(size_t i = r; i < r + count; i++) remove(getRunFilename(i).c_str());
+        }
+        first = last;
+        passes++;
+    }
+    if(!mergeGroup(first, myNumRuns - first, myOptions.output, false, bufferRecords)) return false;
+
+    printf("merge    %d passes, up to %zu runs at once, %zu points per run buffer\n",
+        passes, fanIn, bufferRecords);
+    reportPhase("merge", myNumRecords, recordSize, secondsSince(start));
+    return true;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Merges count runs starting at first into a file. If keepKeys is set, the
+// file is a new run, otherwise the keys are dropped and the file is the
+// sorted output.
+template<typename T>
+bool PointSorter<T>::mergeGroup(size_t first, size_t count, const string& filename, bool keepKeys, size_t bufferRecords)
+{
+    size_t recordSize = sizeof(T) * NUM_FIELDS;
+    size_t outSize = keepKeys ? sizeof(RunRecord) : recordSize;
+
+    vector<RunReader> readers(count);
+    typedef pair<uint64_t, size_t> HeapItem;
+    priority_queue<HeapItem, vector<HeapItem>, greater<HeapItem> > heap;
+    size_t expected = 0;
+    bool ok = true;
+    for(size_t i = 0; i < count; i++)
+    {
+        RunReader& rr = readers[i];
+        string runFilename = getRunFilename(first + i);
+        expected += myRunSizes[first + i];
+        rr.file = fopen(runFilename.c_str(), "rb");
+        if(rr.file == NULL)
+        {
+            fprintf(stderr, "xyzbsort: could not open run file %s\n", runFilename.c_str());
+            ok = false;
+            break;
+        }
+        rr.buffer.resize(bufferRecords);
+        rr.count = 0;
+        rr.pos = 0;
+        if(rr.next()) heap.push(HeapItem(rr.current().key, i));
+    }
+
+    FILE* fout = ok ? fopen(filename.c_str(), "wb") : NULL;
+    if(ok && fout == NULL)
+    {
+        fprintf(stderr, "xyzbsort: could not open %s\n", filename.c_str());
+        ok = false;
+    }
+
+    if(ok)
+    {
+        vector<char> out(bufferRecords * outSize);
+        size_t written = 0;
+        size_t no = 0;
+        while(!heap.empty())
+        {
+            size_t r = heap.top().second;
+            heap.pop();
+
+            RunReader& rr = readers[r];
+            const RunRecord& record = rr.current();
+            if(keepKeys) memcpy(&out[no * outSize], &record, outSize);
+            else memcpy(&out[no * outSize], record.fields, outSize);
+            if(++no == bufferRecords)
+            {
+                written += fwrite(&out[0], outSize, no, fout);
+                no = 0;
+            }
+            if(rr.next()) heap.push(HeapItem(rr.current().key, r));
+        }
+        written += fwrite(&out[0], outSize, no, fout);
+        if(fclose(fout) != 0) written = 0;
+
+        if(written != expected)
+        {
+            // Do not leave a truncated output behind.
+            fprintf(stderr, "xyzbsort: wrote %zu of %zu points to %s\n",
+                written, expected, filename.c_str());
+            remove(filename.c_str());
+            ok = false;
+        }
+    }
+
+    for(size_t i = 0; i < count; i++)
+    {
+        if(readers[i].file != NULL) fclose(readers[i].file);
+    }
+    return ok;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+static void usage()
+{
+    printf(
+        "usage: xyzbsort [options] input.xyzb output.xyzb\n"
+        "  -f               records are single precision floats (default: doubles)\n"
+        "  -c hilbert|morton  space filling curve (default: hilbert)\n"
+        "  -m memoryMB      memory budget (default: 1024)\n"
+        "  -t threads       run generation threads (default: number of cores)\n");
+}
+
+///////////////////////////////////////////////////////////////////////////////
+int main(int argc, char** argv)
+{
+    SortOptions opts;
+    vector<string> files;
+    for(int i = 1; i < argc; i++)
+    {
+        string arg = argv[i];
+        if(arg == "-f") opts.singlePrecision = true;
+        else if(arg == "-c" && i + 1 < argc)
+        {
+            string curve = argv[++i];
+            if(curve == "morton") opts.hilbert = false;
+            else if(curve != "hilbert")
+            {
+                usage();
+                return 1;
+            }
+        }
+        else if(arg == "-m" && i + 1 < argc) opts.memoryMB = strtoul(argv[++i], NULL, 10);
+        else if(arg == "-t" && i + 1 < argc) opts.threads = strtoul(argv[++i], NULL, 10);
+        else if(arg[0] == '-')
+        {
+            usage();
+            return 1;
+        }
+        else files.push_back(arg);
+    }
+
+    if(files.size() != 2 || opts.memoryMB == 0)
+    {
+        usage();
+        return 1;
+    }
+    opts.input = files[0];
+    opts.output = files[1];
+    if(opts.input == opts.output)
+    {
+        fprintf(stderr, "xyzbsort: input and output must be different files\n");
+        return 1;
+    }
+
+    bool result;
+    if(opts.singlePrecision)
+    {
+        PointSorter<float> sorter(opts);
+        result = sorter.run();
+    }
+    else
+    {
+        PointSorter<double> sorter(opts);
+        result = sorter.run();
+    }
+    return result ? 0 : 1;
+}